@@ -26,9 +26,15 @@ struct rcar_cmm {
 	/*
 	 * @lut:		1D-LUT state
 	 * @lut.enabled:	1D-LUT enabled flag
+	 * @lut.valid:		@lut.table matches the hardware table
+	 * @lut.table:		Packed hardware table entries last written
+	 * @lut.writes_saved:	Number of table entry writes skipped
 	 */
 	struct {
 		bool enabled;
+		bool valid;
+		u32 table[CM2_LUT_SIZE];
+		u64 writes_saved;
 	} lut;
 };
 
@@ -47,6 +53,10 @@ static inline void rcar_cmm_write(struct rcar_cmm *rcmm, u32 reg, u32 data)
  *			  and write to the CMM registers
  * @rcmm: Pointer to the CMM device
  * @drm_lut: Pointer to the DRM LUT table
+ *
+ * Only the entries that differ from the cached hardware table are written,
+ * gamma fades usually change a subset of the table only, and commits that
+ * don't change the table don't write any entry.
  */
 static void rcar_cmm_lut_write(struct rcar_cmm *rcmm,
 			       const struct drm_color_lut *drm_lut)
@@ -58,8 +68,16 @@ static void rcar_cmm_lut_write(struct rcar_cmm *rcmm,
 			  | drm_color_lut_extract(drm_lut[i].green, 8) << 8
 			  | drm_color_lut_extract(drm_lut[i].blue, 8);
 
+		if (rcmm->lut.valid && rcmm->lut.table[i] == entry) {
+			rcmm->lut.writes_saved++;
+			continue;
+		}
+
 		rcar_cmm_write(rcmm, CM2_LUT_TBL(i), entry);
+		rcmm->lut.table[i] = entry;
 	}
+
+	rcmm->lut.valid = true;
 }
 
 /*
@@ -147,10 +165,28 @@ void rcar_cmm_disable(struct platform_device *pdev)
 	rcar_cmm_write(rcmm, CM2_LUT_CTRL, 0);
 	rcmm->lut.enabled = false;
 
+	/* The table contents may be lost when the CMM is powered down. */
+	rcmm->lut.valid = false;
+
 	pm_runtime_put(&pdev->dev);
 }
 EXPORT_SYMBOL_GPL(rcar_cmm_disable);
 
+/*
+ * rcar_cmm_lut_writes_saved() - Get the number of skipped LUT entry writes
+ * @pdev: The platform device associated with the CMM instance
+ *
+ * Return: the number of 1D-LUT table entry writes skipped by rcar_cmm_setup()
+ * because the entry already held the value to be written
+ */
+u64 rcar_cmm_lut_writes_saved(struct platform_device *pdev)
+{
+	struct rcar_cmm *rcmm = platform_get_drvdata(pdev);
+
+	return rcmm->lut.writes_saved;
+}
+EXPORT_SYMBOL_GPL(rcar_cmm_lut_writes_saved);
+
 /*
  * rcar_cmm_init() - Initialize the CMM unit
  * @pdev: The platform device associated with the CMM instance
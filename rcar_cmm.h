@@ -8,6 +8,8 @@
 #ifndef __RCAR_CMM_H__
 #define __RCAR_CMM_H__
 
+#include <linux/types.h>
+
 #define CM2_LUT_SIZE		256
 
 struct drm_color_lut;
@@ -33,6 +35,8 @@ void rcar_cmm_disable(struct platform_device *pdev);
 
 int rcar_cmm_setup(struct platform_device *pdev,
 		   const struct rcar_cmm_config *config);
+
+u64 rcar_cmm_lut_writes_saved(struct platform_device *pdev);
 #else
 static inline int rcar_cmm_init(struct platform_device *pdev)
 {
@@ -53,6 +57,11 @@ static inline int rcar_cmm_setup(struct platform_device *pdev,
 {
 	return 0;
 }
+
+static inline u64 rcar_cmm_lut_writes_saved(struct platform_device *pdev)
+{
+	return 0;
+}
 #endif /* IS_ENABLED(CONFIG_DRM_RCAR_CMM) */
 
 #endif /* __RCAR_CMM_H__ */
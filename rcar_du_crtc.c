@@ -8,8 +8,11 @@
  */
 
 #include <linux/clk.h>
+#include <linux/debugfs.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/sys_soc.h>
 
 #include <drm/drm_atomic.h>
@@ -18,6 +21,7 @@
 #include <drm/drm_crtc.h>
 #include <drm/drm_device.h>
 #include <drm/drm_fb_cma_helper.h>
+#include <drm/drm_file.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_plane_helper.h>
 #include <drm/drm_vblank.h>
@@ -30,6 +34,7 @@
 #include "rcar_du_plane.h"
 #include "rcar_du_regs.h"
 #include "rcar_du_vsp.h"
+#include "rcar_du_writeback.h"
 #include "rcar_lvds.h"
 #include "rcar_mipi_dsi.h"
 
@@ -501,15 +506,32 @@ void rcar_du_crtc_finish_page_flip(struct rcar_du_crtc *rcrtc)
 	struct drm_pending_vblank_event *event;
 	struct drm_device *dev = rcrtc->crtc.dev;
 	unsigned long flags;
+	bool has_target;
+	u32 target;
 
 	spin_lock_irqsave(&dev->event_lock, flags);
 	event = rcrtc->event;
+	has_target = rcrtc->event_has_target;
+	target = rcrtc->event_target;
 	rcrtc->event = NULL;
+	rcrtc->event_has_target = false;
 	spin_unlock_irqrestore(&dev->event_lock, flags);
 
 	if (event == NULL)
 		return;
 
+	/*
+	 * The event reports the vblank the flip completed at, account for flips
+	 * that missed their target.
+	 */
+	if (has_target) {
+		spin_lock_irqsave(&rcrtc->vblank_lock, flags);
+		rcrtc->target_stats.flips++;
+		if ((s32)((u32)drm_crtc_vblank_count(&rcrtc->crtc) - target) > 0)
+			rcrtc->target_stats.missed++;
+		spin_unlock_irqrestore(&rcrtc->vblank_lock, flags);
+	}
+
 	spin_lock_irqsave(&dev->event_lock, flags);
 	drm_crtc_send_vblank_event(&rcrtc->crtc, event);
 	wake_up(&rcrtc->flip_wait);
@@ -545,6 +567,159 @@ static void rcar_du_crtc_wait_page_flip(struct rcar_du_crtc *rcrtc)
 	rcar_du_crtc_finish_page_flip(rcrtc);
 }
 
+/*
+ * Compute the time of the next vertical blanking from the timestamp of the
+ * last one and the frame duration. Return -EINVAL if the CRTC isn't running.
+ *
+ * The last vblank timestamp is stale when vblank interrupts are disabled, the
+ * next vblank is then extrapolated from it to the first one after the current
+ * time.
+ */
+int rcar_du_crtc_next_vblank(struct rcar_du_crtc *rcrtc, ktime_t *vblank_time)
+{
+	struct drm_crtc *crtc = &rcrtc->crtc;
+	struct drm_vblank_crtc *vblank = &crtc->dev->vblank[drm_crtc_index(crtc)];
+	ktime_t now = ktime_get();
+	s64 elapsed;
+
+	if (!crtc->state->active || !vblank->framedur_ns)
+		return -EINVAL;
+
+	drm_crtc_vblank_count_and_time(crtc, vblank_time);
+
+	elapsed = ktime_to_ns(ktime_sub(now, *vblank_time));
+	if (elapsed < 0)
+		elapsed = 0;
+
+	*vblank_time = ktime_add_ns(*vblank_time,
+				    (div_s64(elapsed, vblank->framedur_ns) + 1) *
+				    vblank->framedur_ns);
+
+	return 0;
+}
+
+/*
+ * Wait until the vblank preceding the target vblank. The vblank counter wraps
+ * around, targets more than 2^31 vblanks ahead are considered as in the past.
+ */
+void rcar_du_crtc_wait_target_vblank(struct rcar_du_crtc *rcrtc, u32 target)
+{
+	struct drm_crtc *crtc = &rcrtc->crtc;
+	struct drm_vblank_crtc *vblank = &crtc->dev->vblank[drm_crtc_index(crtc)];
+	unsigned long timeout;
+	s32 delta;
+
+	if (drm_crtc_vblank_get(crtc))
+		return;
+
+	delta = target - (u32)drm_crtc_vblank_count(crtc);
+	if (delta <= 1)
+		goto done;
+
+	timeout = nsecs_to_jiffies((u64)delta * vblank->framedur_ns)
+		+ msecs_to_jiffies(100);
+
+	if (!wait_event_timeout(vblank->queue,
+				(s32)(target - (u32)drm_crtc_vblank_count(crtc)) <= 1,
+				timeout))
+		dev_warn(rcrtc->dev->dev, "target vblank %u wait timeout\n",
+			 target);
+
+done:
+	drm_crtc_vblank_put(crtc);
+}
+
+/* -----------------------------------------------------------------------------
+ * Frozen Frame Detection
+ */
+
+static void rcar_du_crtc_freeze_notify(struct work_struct *work)
+{
+	struct rcar_du_crtc *rcrtc =
+		container_of(work, struct rcar_du_crtc, freeze.work);
+	struct drm_device *dev = rcrtc->crtc.dev;
+	char crtc_env[24];
+	char *envp[] = { NULL, crtc_env, NULL };
+
+	envp[0] = READ_ONCE(rcrtc->freeze.frozen) ? "FROZEN=1" : "FROZEN=0";
+	snprintf(crtc_env, sizeof(crtc_env), "CRTC=%u", rcrtc->crtc.base.id);
+
+	kobject_uevent_env(&dev->primary->kdev->kobj, KOBJ_CHANGE, envp);
+}
+
+static void rcar_du_crtc_freeze_update(struct rcar_du_crtc *rcrtc)
+{
+	unsigned int threshold =
+		to_rcar_crtc_state(rcrtc->crtc.state)->freeze_threshold;
+	unsigned long flags;
+
+	if (threshold == READ_ONCE(rcrtc->freeze.threshold))
+		return;
+
+	spin_lock_irqsave(&rcrtc->freeze.lock, flags);
+	rcrtc->freeze.threshold = threshold;
+	rcrtc->freeze.frames = 0;
+	rcrtc->freeze.frozen = false;
+	spin_unlock_irqrestore(&rcrtc->freeze.lock, flags);
+}
+
+/*
+ * Compare the CRC of a completed frame with the previous one, and notify
+ * userspace when the output stays frozen for the configured number of frames,
+ * and when it starts updating again. The CRCs of consecutive frames aren't
+ * comparable while the CRC source rotates across the planes, the detector is
+ * then kept reset.
+ */
+void rcar_du_crtc_freeze_check(struct rcar_du_crtc *rcrtc, u32 crc)
+{
+	struct drm_device *dev = rcrtc->crtc.dev;
+	bool notify = false;
+	unsigned long flags;
+	bool rotate;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	rotate = rcrtc->crc_rotate.enabled;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	spin_lock_irqsave(&rcrtc->freeze.lock, flags);
+
+	if (!rcrtc->freeze.threshold)
+		goto done;
+
+	if (rotate) {
+		rcrtc->freeze.frames = 0;
+		if (rcrtc->freeze.frozen) {
+			rcrtc->freeze.frozen = false;
+			notify = true;
+		}
+		goto done;
+	}
+
+	if (crc != rcrtc->freeze.crc) {
+		rcrtc->freeze.crc = crc;
+		rcrtc->freeze.frames = 0;
+		if (rcrtc->freeze.frozen) {
+			rcrtc->freeze.frozen = false;
+			notify = true;
+		}
+		goto done;
+	}
+
+	if (rcrtc->freeze.frozen ||
+	    ++rcrtc->freeze.frames < rcrtc->freeze.threshold)
+		goto done;
+
+	rcrtc->freeze.frozen = true;
+	rcrtc->freeze.events++;
+	notify = true;
+
+done:
+	spin_unlock_irqrestore(&rcrtc->freeze.lock, flags);
+
+	if (notify)
+		schedule_work(&rcrtc->freeze.work);
+}
+
 /* -----------------------------------------------------------------------------
  * Color Management Module (CMM)
  */
@@ -588,11 +763,20 @@ static void rcar_du_cmm_setup(struct drm_crtc *crtc)
  * Start/Stop and Suspend/Resume
  */
 
+static void rcar_du_crtc_set_bgcolor(struct rcar_du_crtc *rcrtc)
+{
+	u32 bgcolor = to_rcar_crtc_state(rcrtc->crtc.state)->bgcolor;
+
+	rcar_du_crtc_write(rcrtc, BPOR, BPOR_RGB((bgcolor >> 16) & 0xff,
+						 (bgcolor >> 8) & 0xff,
+						 bgcolor & 0xff));
+}
+
 static void rcar_du_crtc_setup(struct rcar_du_crtc *rcrtc)
 {
-	/* Set display off and background to black */
+	/* Set display off to black and program the background color. */
 	rcar_du_crtc_write(rcrtc, DOOR, DOOR_RGB(0, 0, 0));
-	rcar_du_crtc_write(rcrtc, BPOR, BPOR_RGB(0, 0, 0));
+	rcar_du_crtc_set_bgcolor(rcrtc);
 
 	/* Configure display timings and output routing */
 	rcar_du_crtc_set_display_timing(rcrtc);
@@ -750,10 +934,41 @@ static void rcar_du_crtc_stop(struct rcar_du_crtc *rcrtc)
  * CRTC Functions
  */
 
+/*
+ * Highest dot clock of the Gen3 DU channels, in kHz. The dot clock actually
+ * used is the closest one the channel can generate.
+ */
+#define RCAR_DU_OFFSCREEN_CLOCK		297000
+
+/*
+ * CRTCs that drive no display output only feed their writeback connector,
+ * turning the VSP into a memory-to-memory compositor. Their timings don't need
+ * to match any display: use the minimum blanking supported by the hardware
+ * (see rcar_du_crtc_mode_valid()) and the highest dot clock, for frames to be
+ * composed as fast as possible.
+ */
+static void rcar_du_crtc_offscreen_timings(struct drm_display_mode *mode)
+{
+	mode->flags &= ~(DRM_MODE_FLAG_INTERLACE | DRM_MODE_FLAG_DBLSCAN);
+
+	mode->hsync_start = mode->hdisplay + 4;
+	mode->hsync_end = mode->hsync_start + 4;
+	mode->htotal = mode->hsync_start + 20;
+
+	mode->vsync_start = mode->vdisplay + 1;
+	mode->vsync_end = mode->vsync_start + 1;
+	mode->vtotal = mode->vsync_end + 3;
+
+	mode->clock = RCAR_DU_OFFSCREEN_CLOCK;
+
+	drm_mode_set_crtcinfo(mode, 0);
+}
+
 static int rcar_du_crtc_atomic_check(struct drm_crtc *crtc,
 				     struct drm_crtc_state *state)
 {
 	struct rcar_du_crtc_state *rstate = to_rcar_crtc_state(state);
+	struct rcar_du_crtc *rcrtc = to_rcar_crtc(crtc);
 	struct drm_encoder *encoder;
 	int ret;
 
@@ -775,6 +990,33 @@ static int rcar_du_crtc_atomic_check(struct drm_crtc *crtc,
 		rstate->outputs |= BIT(renc->output);
 	}
 
+	if (rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE) &&
+	    state->enable && !rstate->outputs &&
+	    drm_atomic_crtc_needs_modeset(state))
+		rcar_du_crtc_offscreen_timings(&state->adjusted_mode);
+
+	/* Legacy page flips set the target without the property. */
+	if (state->target_vblank)
+		rstate->has_target = true;
+
+	/*
+	 * The commit tail waits for the target vblank, reject targets more than
+	 * one second ahead to avoid stalling the commits.
+	 */
+	if (rstate->has_target && state->active &&
+	    !drm_atomic_crtc_needs_modeset(state)) {
+		int max = max(drm_mode_vrefresh(&state->adjusted_mode), 1);
+		s32 delta = state->target_vblank
+			  - (u32)drm_crtc_vblank_count(crtc);
+
+		if (delta > max) {
+			dev_dbg(rcrtc->dev->dev,
+				"%s: target vblank %u too far ahead\n",
+				__func__, state->target_vblank);
+			return -EINVAL;
+		}
+	}
+
 	return 0;
 }
 
@@ -885,8 +1127,10 @@ static void rcar_du_crtc_atomic_begin(struct drm_crtc *crtc,
 	if (crtc->state->color_mgmt_changed && !crtc->state->active_changed)
 		rcar_du_cmm_setup(crtc);
 
-	if (rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE))
+	if (rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE)) {
+		rcar_du_vsp_mailbox_wait(rcrtc);
 		rcar_du_vsp_atomic_begin(rcrtc);
+	}
 }
 
 static void rcar_du_crtc_atomic_flush(struct drm_crtc *crtc,
@@ -894,8 +1138,13 @@ static void rcar_du_crtc_atomic_flush(struct drm_crtc *crtc,
 {
 	struct rcar_du_crtc *rcrtc = to_rcar_crtc(crtc);
 	struct drm_device *dev = rcrtc->crtc.dev;
+	struct drm_connector_state *wb_state;
 	unsigned long flags;
 
+	if (to_rcar_crtc_state(old_crtc_state)->bgcolor !=
+	    to_rcar_crtc_state(crtc->state)->bgcolor)
+		rcar_du_crtc_set_bgcolor(rcrtc);
+
 	rcar_du_crtc_update_planes(rcrtc);
 
 	if (crtc->state->event) {
@@ -903,12 +1152,29 @@ static void rcar_du_crtc_atomic_flush(struct drm_crtc *crtc,
 
 		spin_lock_irqsave(&dev->event_lock, flags);
 		rcrtc->event = crtc->state->event;
+		rcrtc->event_has_target =
+			to_rcar_crtc_state(crtc->state)->has_target;
+		rcrtc->event_target = crtc->state->target_vblank;
 		crtc->state->event = NULL;
 		spin_unlock_irqrestore(&dev->event_lock, flags);
 	}
 
-	if (rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE))
-		rcar_du_vsp_atomic_flush(rcrtc);
+	if (!rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE))
+		return;
+
+	rcar_du_crtc_freeze_update(rcrtc);
+
+	/*
+	 * The capture framebuffers cache serves continuous capture, which can
+	 * skip frames. Keep it as long as the writeback connector is attached
+	 * to the CRTC, and drop it when capture is stopped by detaching the
+	 * connector. The cache is also dropped when the CRTC is disabled.
+	 */
+	wb_state = rcrtc->writeback.base.state;
+	if (!wb_state || wb_state->crtc != crtc)
+		rcar_du_writeback_release_cache(rcrtc);
+
+	rcar_du_vsp_atomic_flush(rcrtc);
 }
 
 static enum drm_mode_status
@@ -923,6 +1189,17 @@ rcar_du_crtc_mode_valid(struct drm_crtc *crtc,
 	if (interlaced && !rcar_du_has(rcdu, RCAR_DU_FEATURE_INTERLACED))
 		return MODE_NO_INTERLACE;
 
+	/*
+	 * The maximum framebuffer size exceeds the size of the frames the VSP
+	 * can process.
+	 */
+	if (rcar_du_has(rcdu, RCAR_DU_FEATURE_VSP1_SOURCE)) {
+		if (mode->hdisplay > RCAR_DU_VSP_MAX_SIZE)
+			return MODE_BAD_HVALUE;
+		if (mode->vdisplay > RCAR_DU_VSP_MAX_SIZE)
+			return MODE_BAD_VVALUE;
+	}
+
 	/*
 	 * The hardware requires a minimum combined horizontal sync and back
 	 * porch of 20 pixels and a minimum vertical back porch of 3 lines.
@@ -957,8 +1234,8 @@ static void rcar_du_crtc_crc_init(struct rcar_du_crtc *rcrtc)
 	if (rcdu->info->gen < 3)
 		return;
 
-	/* Reserve 1 for "auto" source. */
-	count = rcrtc->vsp->num_planes + 1;
+	/* Reserve 2 for "auto" and "rotate" sources. */
+	count = rcrtc->vsp->num_planes + 2;
 
 	sources = kmalloc_array(count, sizeof(*sources), GFP_KERNEL);
 	if (!sources)
@@ -978,6 +1255,10 @@ static void rcar_du_crtc_crc_init(struct rcar_du_crtc *rcrtc)
 			goto error;
 	}
 
+	sources[i + 1] = kstrdup("rotate", GFP_KERNEL);
+	if (!sources[i + 1])
+		goto error;
+
 	rcrtc->sources = sources;
 	rcrtc->sources_count = count;
 	return;
@@ -1005,6 +1286,99 @@ static void rcar_du_crtc_crc_cleanup(struct rcar_du_crtc *rcrtc)
 	rcrtc->sources_count = 0;
 }
 
+/*
+ * Flush a new display list to move the rotating CRC source to the next plane
+ * when no commit did so for the frame. The display list is only flushed when
+ * the last commit has been fully applied and all the display lists flushed
+ * before are displayed. Flushed behind another display list, it would be kept
+ * pending by the VSP and could replace the display list of a mailbox flip.
+ * Commits wait for it to be displayed before flushing their own display list,
+ * see rcar_du_vsp_mailbox_wait(). It is never flushed for CRTCs with a pending
+ * writeback job, which are flushed by commits only.
+ *
+ * The display list is built from the state of the CRTC and of the VSP planes,
+ * only their locks are taken.
+ */
+static void rcar_du_crtc_crc_rotate(struct work_struct *work)
+{
+	struct rcar_du_crtc *rcrtc =
+		container_of(work, struct rcar_du_crtc, crc_rotate.work);
+	struct rcar_du_vsp *vsp = rcrtc->vsp;
+	struct drm_modeset_acquire_ctx ctx;
+	struct drm_crtc_state *state;
+	unsigned int i;
+	int ret;
+
+	drm_modeset_acquire_init(&ctx, 0);
+
+retry:
+	ret = drm_modeset_lock(&rcrtc->crtc.mutex, &ctx);
+	if (ret)
+		goto unlock;
+
+	for (i = 0; i < vsp->num_planes; ++i) {
+		ret = drm_modeset_lock(&vsp->planes[i].plane.mutex, &ctx);
+		if (ret)
+			goto unlock;
+	}
+
+	state = rcrtc->crtc.state;
+
+	if (!state->active || !to_rcar_crtc_state(state)->crc_rotate)
+		goto unlock;
+
+	if (state->commit && !try_wait_for_completion(&state->commit->hw_done))
+		goto unlock;
+
+	if (rcar_du_writeback_pending(rcrtc) || rcar_du_vsp_dl_pending(rcrtc))
+		goto unlock;
+
+	rcar_du_vsp_atomic_begin(rcrtc);
+	rcar_du_vsp_atomic_flush(rcrtc);
+
+unlock:
+	if (ret == -EDEADLK) {
+		drm_modeset_backoff(&ctx);
+		goto retry;
+	}
+
+	drm_modeset_drop_locks(&ctx);
+	drm_modeset_acquire_fini(&ctx);
+}
+
+/*
+ * Report the CRC of a completed frame. With the rotating source the CRC is
+ * reported along with the ID of the plane it has been computed on, and the
+ * source is moved to the next plane.
+ */
+void rcar_du_crtc_crc_complete(struct rcar_du_crtc *rcrtc, bool complete,
+			       u32 crc)
+{
+	struct drm_device *dev = rcrtc->crtc.dev;
+	unsigned long flags;
+	u32 values[2];
+	bool rotate;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	rotate = rcrtc->crc_rotate.enabled;
+	values[0] = rcrtc->crc_rotate.active;
+	if (complete)
+		rcrtc->crc_rotate.active = rcrtc->crc_rotate.queued;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	if (!rotate) {
+		values[0] = crc;
+		values[1] = 0;
+		drm_crtc_add_crc_entry(&rcrtc->crtc, false, 0, values);
+		return;
+	}
+
+	values[1] = crc;
+	drm_crtc_add_crc_entry(&rcrtc->crtc, false, 0, values);
+
+	schedule_work(&rcrtc->crc_rotate.work);
+}
+
 static struct drm_crtc_state *
 rcar_du_crtc_atomic_duplicate_state(struct drm_crtc *crtc)
 {
@@ -1015,11 +1389,15 @@ rcar_du_crtc_atomic_duplicate_state(struct drm_crtc *crtc)
 		return NULL;
 
 	state = to_rcar_crtc_state(crtc->state);
-	copy = kmemdup(state, sizeof(*state), GFP_KERNEL);
+	copy = kmem_cache_alloc(rcar_du_crtc_state_cache, GFP_KERNEL);
 	if (copy == NULL)
 		return NULL;
 
+	*copy = *state;
+
 	__drm_atomic_helper_crtc_duplicate_state(crtc, &copy->state);
+	copy->state.target_vblank = 0;
+	copy->has_target = false;
 
 	return &copy->state;
 }
@@ -1028,7 +1406,140 @@ static void rcar_du_crtc_atomic_destroy_state(struct drm_crtc *crtc,
 					      struct drm_crtc_state *state)
 {
 	__drm_atomic_helper_crtc_destroy_state(state);
-	kfree(to_rcar_crtc_state(state));
+	kmem_cache_free(rcar_du_crtc_state_cache, to_rcar_crtc_state(state));
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int rcar_du_crtc_fence_stats_show(struct seq_file *m, void *arg)
+{
+	struct rcar_du_crtc *rcrtc = m->private;
+	unsigned int fences;
+	unsigned int late;
+
+	spin_lock_irq(&rcrtc->vblank_lock);
+	fences = rcrtc->fence_stats.fences;
+	late = rcrtc->fence_stats.late;
+	spin_unlock_irq(&rcrtc->vblank_lock);
+
+	seq_printf(m, "fences: %u\n", fences);
+	seq_printf(m, "late: %u\n", late);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(rcar_du_crtc_fence_stats);
+
+static int rcar_du_crtc_target_stats_show(struct seq_file *m, void *arg)
+{
+	struct rcar_du_crtc *rcrtc = m->private;
+	unsigned int flips;
+	unsigned int missed;
+
+	spin_lock_irq(&rcrtc->vblank_lock);
+	flips = rcrtc->target_stats.flips;
+	missed = rcrtc->target_stats.missed;
+	spin_unlock_irq(&rcrtc->vblank_lock);
+
+	seq_printf(m, "flips: %u\n", flips);
+	seq_printf(m, "missed: %u\n", missed);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(rcar_du_crtc_target_stats);
+
+static int rcar_du_crtc_freeze_stats_show(struct seq_file *m, void *arg)
+{
+	struct rcar_du_crtc *rcrtc = m->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rcrtc->freeze.lock, flags);
+	seq_printf(m, "threshold: %u\n", rcrtc->freeze.threshold);
+	seq_printf(m, "frozen: %u\n", rcrtc->freeze.frozen);
+	seq_printf(m, "frames: %u\n", rcrtc->freeze.frames);
+	seq_printf(m, "events: %u\n", rcrtc->freeze.events);
+	spin_unlock_irqrestore(&rcrtc->freeze.lock, flags);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(rcar_du_crtc_freeze_stats);
+
+static int rcar_du_crtc_cmm_stats_show(struct seq_file *m, void *arg)
+{
+	struct rcar_du_crtc *rcrtc = m->private;
+
+	seq_printf(m, "lut_writes_saved: %llu\n",
+		   rcar_cmm_lut_writes_saved(rcrtc->cmm));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(rcar_du_crtc_cmm_stats);
+
+static int rcar_du_crtc_late_register(struct drm_crtc *crtc)
+{
+	struct rcar_du_crtc *rcrtc = to_rcar_crtc(crtc);
+
+	debugfs_create_file("fence_stats", 0444, crtc->debugfs_entry, rcrtc,
+			    &rcar_du_crtc_fence_stats_fops);
+	debugfs_create_file("target_stats", 0444, crtc->debugfs_entry, rcrtc,
+			    &rcar_du_crtc_target_stats_fops);
+	if (rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE))
+		debugfs_create_file("freeze_stats", 0444, crtc->debugfs_entry,
+				    rcrtc, &rcar_du_crtc_freeze_stats_fops);
+	if (rcrtc->cmm)
+		debugfs_create_file("cmm_stats", 0444, crtc->debugfs_entry,
+				    rcrtc, &rcar_du_crtc_cmm_stats_fops);
+
+	return 0;
+}
+#else
+#define rcar_du_crtc_late_register	NULL
+#endif
+
+static int rcar_du_crtc_atomic_set_property(struct drm_crtc *crtc,
+					    struct drm_crtc_state *state,
+					    struct drm_property *property,
+					    uint64_t val)
+{
+	struct rcar_du_crtc_state *rstate = to_rcar_crtc_state(state);
+	struct rcar_du_device *rcdu = to_rcar_crtc(crtc)->dev;
+
+	if (property == rcdu->props.bgcolor) {
+		rstate->bgcolor = val;
+	} else if (property == rcdu->props.target_vblank) {
+		/* Values are taken modulo 2^32, 2^32 targets vblank 0. */
+		state->target_vblank = lower_32_bits(val);
+		rstate->has_target = val != 0;
+	} else if (property == rcdu->props.freeze_threshold) {
+		rstate->freeze_threshold = val;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int rcar_du_crtc_atomic_get_property(struct drm_crtc *crtc,
+	const struct drm_crtc_state *state, struct drm_property *property,
+	uint64_t *val)
+{
+	const struct rcar_du_crtc_state *rstate =
+		container_of(state, const struct rcar_du_crtc_state, state);
+	struct rcar_du_device *rcdu = to_rcar_crtc(crtc)->dev;
+
+	if (property == rcdu->props.bgcolor)
+		*val = rstate->bgcolor;
+	else if (property == rcdu->props.target_vblank)
+		*val = rstate->has_target && !state->target_vblank
+		     ? BIT_ULL(32) : state->target_vblank;
+	else if (property == rcdu->props.freeze_threshold)
+		*val = rstate->freeze_threshold;
+	else
+		return -EINVAL;
+
+	return 0;
 }
 
 static void rcar_du_crtc_cleanup(struct drm_crtc *crtc)
@@ -1036,6 +1547,8 @@ static void rcar_du_crtc_cleanup(struct drm_crtc *crtc)
 	struct rcar_du_crtc *rcrtc = to_rcar_crtc(crtc);
 
 	rcar_du_crtc_crc_cleanup(rcrtc);
+	cancel_work_sync(&rcrtc->freeze.work);
+	cancel_work_sync(&rcrtc->crc_rotate.work);
 
 	return drm_crtc_cleanup(crtc);
 }
@@ -1049,7 +1562,7 @@ static void rcar_du_crtc_reset(struct drm_crtc *crtc)
 		crtc->state = NULL;
 	}
 
-	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	state = kmem_cache_zalloc(rcar_du_crtc_state_cache, GFP_KERNEL);
 	if (state == NULL)
 		return;
 
@@ -1080,23 +1593,31 @@ static void rcar_du_crtc_disable_vblank(struct drm_crtc *crtc)
 
 static int rcar_du_crtc_parse_crc_source(struct rcar_du_crtc *rcrtc,
 					 const char *source_name,
-					 enum vsp1_du_crc_source *source)
+					 enum vsp1_du_crc_source *source,
+					 bool *rotate)
 {
 	unsigned int index;
 	int ret;
 
 	/*
 	 * Parse the source name. Supported values are "plane%u" to compute the
-	 * CRC on an input plane (%u is the plane ID), and "auto" to compute the
-	 * CRC on the composer (VSP) output.
+	 * CRC on an input plane (%u is the plane ID), "auto" to compute the
+	 * CRC on the composer (VSP) output, and "rotate" to compute the CRC on
+	 * a different plane of the CRTC every frame.
 	 */
 
+	*rotate = false;
+
 	if (!source_name) {
 		*source = VSP1_DU_CRC_NONE;
 		return 0;
 	} else if (!strcmp(source_name, "auto")) {
 		*source = VSP1_DU_CRC_OUTPUT;
 		return 0;
+	} else if (!strcmp(source_name, "rotate")) {
+		*source = VSP1_DU_CRC_PLANE;
+		*rotate = true;
+		return 0;
 	} else if (strstarts(source_name, "plane")) {
 		unsigned int i;
 
@@ -1121,13 +1642,16 @@ static int rcar_du_crtc_verify_crc_source(struct drm_crtc *crtc,
 {
 	struct rcar_du_crtc *rcrtc = to_rcar_crtc(crtc);
 	enum vsp1_du_crc_source source;
+	bool rotate;
 
-	if (rcar_du_crtc_parse_crc_source(rcrtc, source_name, &source) < 0) {
+	if (rcar_du_crtc_parse_crc_source(rcrtc, source_name, &source,
+					  &rotate) < 0) {
 		DRM_DEBUG_DRIVER("unknown source %s\n", source_name);
 		return -EINVAL;
 	}
 
-	*values_cnt = 1;
+	/* The rotating source reports (plane ID, CRC) pairs. */
+	*values_cnt = rotate ? 2 : 1;
 	return 0;
 }
 
@@ -1149,9 +1673,11 @@ static int rcar_du_crtc_set_crc_source(struct drm_crtc *crtc,
 	struct drm_atomic_state *state;
 	enum vsp1_du_crc_source source;
 	unsigned int index;
+	bool rotate;
 	int ret;
 
-	ret = rcar_du_crtc_parse_crc_source(rcrtc, source_name, &source);
+	ret = rcar_du_crtc_parse_crc_source(rcrtc, source_name, &source,
+					    &rotate);
 	if (ret < 0)
 		return ret;
 
@@ -1176,6 +1702,7 @@ retry:
 		rcrtc_state = to_rcar_crtc_state(crtc_state);
 		rcrtc_state->crc.source = source;
 		rcrtc_state->crc.index = index;
+		rcrtc_state->crc_rotate = rotate;
 
 		ret = drm_atomic_commit(state);
 	} else {
@@ -1197,13 +1724,53 @@ unlock:
 	return ret;
 }
 
+/*
+ * Asynchronous page flips have mailbox semantics on VSP-based devices, see
+ * rcar_du_vsp_page_flip(). Flips that can't be handled that way fall back to
+ * regular page flips.
+ */
+static int rcar_du_crtc_page_flip(struct drm_crtc *crtc,
+				  struct drm_framebuffer *fb,
+				  struct drm_pending_vblank_event *event,
+				  u32 flags, struct drm_modeset_acquire_ctx *ctx)
+{
+	struct rcar_du_crtc *rcrtc = to_rcar_crtc(crtc);
+	int ret;
+
+	if ((flags & DRM_MODE_PAGE_FLIP_ASYNC) &&
+	    rcar_du_has(rcrtc->dev, RCAR_DU_FEATURE_VSP1_SOURCE)) {
+		ret = rcar_du_vsp_page_flip(rcrtc, fb, event);
+		if (ret != -EAGAIN)
+			return ret;
+	}
+
+	return drm_atomic_helper_page_flip(crtc, fb, event, flags, ctx);
+}
+
+static int rcar_du_crtc_page_flip_target(struct drm_crtc *crtc,
+					 struct drm_framebuffer *fb,
+					 struct drm_pending_vblank_event *event,
+					 u32 flags, u32 target,
+					 struct drm_modeset_acquire_ctx *ctx)
+{
+	if (flags & DRM_MODE_PAGE_FLIP_ASYNC)
+		return rcar_du_crtc_page_flip(crtc, fb, event, flags, ctx);
+
+	return drm_atomic_helper_page_flip_target(crtc, fb, event, flags,
+						  target, ctx);
+}
+
 static const struct drm_crtc_funcs crtc_funcs_gen2 = {
 	.reset = rcar_du_crtc_reset,
 	.destroy = drm_crtc_cleanup,
 	.set_config = drm_atomic_helper_set_config,
 	.page_flip = drm_atomic_helper_page_flip,
+	.page_flip_target = drm_atomic_helper_page_flip_target,
 	.atomic_duplicate_state = rcar_du_crtc_atomic_duplicate_state,
 	.atomic_destroy_state = rcar_du_crtc_atomic_destroy_state,
+	.atomic_set_property = rcar_du_crtc_atomic_set_property,
+	.atomic_get_property = rcar_du_crtc_atomic_get_property,
+	.late_register = rcar_du_crtc_late_register,
 	.enable_vblank = rcar_du_crtc_enable_vblank,
 	.disable_vblank = rcar_du_crtc_disable_vblank,
 };
@@ -1212,9 +1779,13 @@ static const struct drm_crtc_funcs crtc_funcs_gen3 = {
 	.reset = rcar_du_crtc_reset,
 	.destroy = rcar_du_crtc_cleanup,
 	.set_config = drm_atomic_helper_set_config,
-	.page_flip = drm_atomic_helper_page_flip,
+	.page_flip = rcar_du_crtc_page_flip,
+	.page_flip_target = rcar_du_crtc_page_flip_target,
 	.atomic_duplicate_state = rcar_du_crtc_atomic_duplicate_state,
 	.atomic_destroy_state = rcar_du_crtc_atomic_destroy_state,
+	.atomic_set_property = rcar_du_crtc_atomic_set_property,
+	.atomic_get_property = rcar_du_crtc_atomic_get_property,
+	.late_register = rcar_du_crtc_late_register,
 	.enable_vblank = rcar_du_crtc_enable_vblank,
 	.disable_vblank = rcar_du_crtc_disable_vblank,
 	.set_crc_source = rcar_du_crtc_set_crc_source,
@@ -1321,6 +1892,10 @@ int rcar_du_crtc_create(struct rcar_du_group *rgrp, unsigned int swindex,
 	init_waitqueue_head(&rcrtc->flip_wait);
 	init_waitqueue_head(&rcrtc->vblank_wait);
 	spin_lock_init(&rcrtc->vblank_lock);
+	spin_lock_init(&rcrtc->freeze.lock);
+	INIT_WORK(&rcrtc->freeze.work, rcar_du_crtc_freeze_notify);
+	INIT_WORK(&rcrtc->crc_rotate.work, rcar_du_crtc_crc_rotate);
+	rcar_du_vsp_mailbox_init(rcrtc);
 
 	rcrtc->dev = rcdu;
 	rcrtc->group = rgrp;
@@ -1360,6 +1935,12 @@ int rcar_du_crtc_create(struct rcar_du_group *rgrp, unsigned int swindex,
 
 	drm_crtc_helper_add(crtc, &crtc_helper_funcs);
 
+	drm_object_attach_property(&crtc->base, rcdu->props.bgcolor, 0);
+	drm_object_attach_property(&crtc->base, rcdu->props.target_vblank, 0);
+	if (rcar_du_has(rcdu, RCAR_DU_FEATURE_VSP1_SOURCE))
+		drm_object_attach_property(&crtc->base,
+					   rcdu->props.freeze_threshold, 0);
+
 	/* Register the interrupt handler. */
 	if (rcar_du_has(rcdu, RCAR_DU_FEATURE_CRTC_IRQ_CLOCK)) {
 		/* The IRQ's are associated with the CRTC (sw)index. */
@@ -10,15 +10,20 @@
 #ifndef __RCAR_DU_CRTC_H__
 #define __RCAR_DU_CRTC_H__
 
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <drm/drm_crtc.h>
 #include <drm/drm_writeback.h>
 
 #include <media/vsp1.h>
 
+#include "rcar_du_writeback.h"
+
 struct rcar_du_group;
 struct rcar_du_vsp;
 
@@ -34,8 +39,11 @@ struct rcar_du_vsp;
  * @dsysr: cached value of the DSYSR register
  * @vblank_enable: whether vblank events are enabled on this CRTC
  * @event: event to post when the pending page flip completes
+ * @event_has_target: whether the pending page flip targets a vblank
+ * @event_target: vblank targeted by the pending page flip
  * @flip_wait: wait queue used to signal page flip completion
- * @vblank_lock: protects vblank_wait and vblank_count
+ * @vblank_lock: protects vblank_wait, vblank_count, fence_stats and
+ * target_stats
  * @vblank_wait: wait queue used to signal vertical blanking
  * @vblank_count: number of vertical blanking interrupts to wait for
  * @group: CRTC group this CRTC belongs to
@@ -43,6 +51,34 @@ struct rcar_du_vsp;
  * @vsp: VSP feeding video to this CRTC
  * @vsp_pipe: index of the VSP pipeline feeding video to this CRTC
  * @writeback: the writeback connector
+ * @wb_pool: writeback job pool and mapping cache
+ * @fence_stats: statistics about plane in-fences
+ * @fence_stats.fences: number of in-fences waited for
+ * @fence_stats.late: number of in-fences signaled after their deadline
+ * @target_stats: statistics about page flips targeting a vblank
+ * @target_stats.flips: number of page flips that targeted a vblank
+ * @target_stats.missed: number of page flips completed after their target
+ * @mailbox: state of the mailbox (asynchronous) page flips
+ * @mailbox.queued: number of display lists flushed to the VSP that haven't
+ * started being displayed yet
+ * @mailbox.flips: mailbox flips whose framebuffer hasn't been released yet
+ * @mailbox.release_work: work releasing the framebuffers replaced by the flips
+ * @freeze: state of the frozen frame detector
+ * @freeze.lock: protects the fields below, except for @freeze.work
+ * @freeze.threshold: number of consecutive identical frames after which the
+ * output is considered frozen, 0 if the detector is disabled
+ * @freeze.crc: CRC of the last frame
+ * @freeze.frames: number of consecutive frames with the same CRC
+ * @freeze.frozen: whether the output is currently frozen
+ * @freeze.events: number of times the output has been detected as frozen
+ * @freeze.work: work notifying userspace of freeze state changes
+ * @crc_rotate: state of the rotating CRC source
+ * @crc_rotate.enabled: whether the CRC source rotates across the planes
+ * @crc_rotate.queued: ID of the plane whose CRC is computed by the last flushed
+ * display list, 0 for the composer output
+ * @crc_rotate.active: ID of the plane whose CRC is computed for the current
+ * frame, 0 for the composer output
+ * @crc_rotate.work: work flushing a display list to rotate the CRC source
  */
 struct rcar_du_crtc {
 	struct drm_crtc crtc;
@@ -58,6 +94,8 @@ struct rcar_du_crtc {
 
 	bool vblank_enable;
 	struct drm_pending_vblank_event *event;
+	bool event_has_target;
+	u32 event_target;
 	wait_queue_head_t flip_wait;
 
 	spinlock_t vblank_lock;
@@ -73,6 +111,40 @@ struct rcar_du_crtc {
 	unsigned int sources_count;
 
 	struct drm_writeback_connector writeback;
+	struct rcar_du_wb_pool wb_pool;
+
+	struct {
+		unsigned int fences;
+		unsigned int late;
+	} fence_stats;
+
+	struct {
+		unsigned int flips;
+		unsigned int missed;
+	} target_stats;
+
+	struct {
+		unsigned int queued;
+		struct list_head flips;
+		struct work_struct release_work;
+	} mailbox;
+
+	struct {
+		spinlock_t lock;
+		unsigned int threshold;
+		u32 crc;
+		unsigned int frames;
+		bool frozen;
+		unsigned int events;
+		struct work_struct work;
+	} freeze;
+
+	struct {
+		bool enabled;
+		u32 queued;
+		u32 active;
+		struct work_struct work;
+	} crc_rotate;
 };
 
 #define to_rcar_crtc(c)		container_of(c, struct rcar_du_crtc, crtc)
@@ -82,13 +154,23 @@ struct rcar_du_crtc {
  * struct rcar_du_crtc_state - Driver-specific CRTC state
  * @state: base DRM CRTC state
  * @crc: CRC computation configuration
+ * @crc_rotate: whether the CRC source rotates across the planes every frame
  * @outputs: bitmask of the outputs (enum rcar_du_output) driven by this CRTC
+ * @bgcolor: background color in XRGB8888 format
+ * @has_target: whether the commit targets the vblank stored in the
+ * target_vblank field of @state
+ * @freeze_threshold: number of identical frames after which the output is
+ * reported as frozen, 0 disables the frozen frame detector
  */
 struct rcar_du_crtc_state {
 	struct drm_crtc_state state;
 
 	struct vsp1_du_crc_config crc;
+	bool crc_rotate;
 	unsigned int outputs;
+	u32 bgcolor;
+	bool has_target;
+	unsigned int freeze_threshold;
 };
 
 #define to_rcar_crtc_state(s) container_of(s, struct rcar_du_crtc_state, state)
@@ -113,4 +195,12 @@ void rcar_du_crtc_finish_page_flip(struct rcar_du_crtc *rcrtc);
 
 void rcar_du_crtc_dsysr_clr_set(struct rcar_du_crtc *rcrtc, u32 clr, u32 set);
 
+int rcar_du_crtc_next_vblank(struct rcar_du_crtc *rcrtc, ktime_t *vblank_time);
+void rcar_du_crtc_wait_target_vblank(struct rcar_du_crtc *rcrtc, u32 target);
+
+void rcar_du_crtc_freeze_check(struct rcar_du_crtc *rcrtc, u32 crc);
+
+void rcar_du_crtc_crc_complete(struct rcar_du_crtc *rcrtc, bool complete,
+			       u32 crc);
+
 #endif /* __RCAR_DU_CRTC_H__ */
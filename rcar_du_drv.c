@@ -31,6 +31,7 @@
 
 #include "rcar_du_drv.h"
 #include "rcar_du_encoder.h"
+#include "rcar_du_gem.h"
 #include "rcar_du_kms.h"
 #include "rcar_du_of.h"
 #include "rcar_du_regs.h"
@@ -546,7 +547,17 @@ static const struct drm_ioctl_desc rcar_du_ioctls[] = {
 			  DRM_UNLOCKED),
 };
 
-DEFINE_DRM_GEM_CMA_FOPS(rcar_du_fops);
+static const struct file_operations rcar_du_fops = {
+	.owner		= THIS_MODULE,
+	.open		= drm_open,
+	.release	= drm_release,
+	.unlocked_ioctl	= drm_ioctl,
+	.compat_ioctl	= drm_compat_ioctl,
+	.poll		= drm_poll,
+	.read		= drm_read,
+	.llseek		= noop_llseek,
+	.mmap		= rcar_du_gem_mmap,
+};
 
 static struct drm_driver rcar_du_driver = {
 	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
@@ -568,7 +579,7 @@ static struct drm_driver rcar_du_driver = {
 	.gem_prime_import_sg_table = rcar_du_gem_prime_import_sg_table,
 	.gem_prime_vmap		= drm_gem_cma_prime_vmap,
 	.gem_prime_vunmap	= drm_gem_cma_prime_vunmap,
-	.gem_prime_mmap		= drm_gem_cma_prime_mmap,
+	.gem_prime_mmap		= rcar_du_gem_prime_mmap,
 	.dumb_create		= rcar_du_dumb_create,
 };
 
@@ -742,15 +753,26 @@ static struct platform_driver rcar_du_platform_driver = {
 
 static int __init rcar_du_init(void)
 {
+	int ret;
+
+	ret = rcar_du_kms_init_caches();
+	if (ret < 0)
+		return ret;
+
 	rcar_du_of_init(rcar_du_of_table);
 
-	return platform_driver_register(&rcar_du_platform_driver);
+	ret = platform_driver_register(&rcar_du_platform_driver);
+	if (ret < 0)
+		rcar_du_kms_destroy_caches();
+
+	return ret;
 }
 module_init(rcar_du_init);
 
 static void __exit rcar_du_exit(void)
 {
 	platform_driver_unregister(&rcar_du_platform_driver);
+	rcar_du_kms_destroy_caches();
 }
 module_exit(rcar_du_exit);
 
@@ -15,6 +15,7 @@
 
 #include "rcar_cmm.h"
 #include "rcar_du_crtc.h"
+#include "rcar_du_gem.h"
 #include "rcar_du_group.h"
 #include "rcar_du_vsp.h"
 
@@ -106,6 +107,9 @@ struct rcar_du_device {
 		struct drm_property *alpha;
 		struct drm_property *colorkey;
 		struct drm_property *colorkey_alpha;
+		struct drm_property *bgcolor;
+		struct drm_property *target_vblank;
+		struct drm_property *freeze_threshold;
 	} props;
 
 	unsigned int dpad0_source;
@@ -113,6 +117,8 @@ struct rcar_du_device {
 	unsigned int vspd1_sink;
 	bool vspdl_fix;
 	unsigned int brs_num;
+	bool paged_buffers;
+	struct rcar_du_gem_pool gem_pool;
 
 	bool mode_config_initialized;
 };
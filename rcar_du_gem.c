@@ -0,0 +1,579 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * rcar_du_gem.c  --  R-Car Display Unit GEM Objects
+ *
+ * Copyright (C) 2013-2018 Renesas Electronics Corporation
+ *
+ * Contact: Laurent Pinchart (laurent.pinchart@ideasonboard.com)
+ */
+
+#include <drm/drm_device.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_file.h>
+#include <drm/drm_gem.h>
+#include <drm/drm_gem_cma_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_prime.h>
+#include <drm/drm_vma_manager.h>
+#include <drm/rcar_du_drm.h>
+
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "rcar_du_drv.h"
+#include "rcar_du_gem.h"
+
+/* -----------------------------------------------------------------------------
+ * Backing Stores
+ */
+
+static void rcar_du_gem_backing_free(struct drm_device *dev,
+				     struct rcar_du_gem_backing *backing)
+{
+	unsigned int num_pages = backing->size >> PAGE_SHIFT;
+	unsigned int i;
+
+	if (backing->vaddr)
+		dma_free_wc(dev->dev, backing->size, backing->vaddr,
+			    backing->paddr);
+
+	if (backing->sgt) {
+		if (backing->mapped)
+			dma_unmap_sgtable(dev->dev, backing->sgt, DMA_TO_DEVICE,
+					  0);
+		sg_free_table(backing->sgt);
+		kfree(backing->sgt);
+	}
+
+	if (backing->pages) {
+		for (i = 0; i < num_pages; ++i) {
+			if (backing->pages[i])
+				__free_page(backing->pages[i]);
+		}
+
+		kvfree(backing->pages);
+	}
+
+	kfree(backing);
+}
+
+/*
+ * Pages are written through the cached kernel mapping when zeroed, while the
+ * CPU accesses them through write-combined mappings and the VSP through DMA.
+ * Clean the caches to avoid dirty cache lines being evicted over the buffer
+ * contents. The pages stay mapped to the DU for the lifetime of the backing
+ * store, cleaning the caches is then a sync operation only.
+ */
+static void rcar_du_gem_backing_clean(struct drm_device *dev,
+				      struct rcar_du_gem_backing *backing)
+{
+	dma_sync_sgtable_for_device(dev->dev, backing->sgt, DMA_TO_DEVICE);
+}
+
+static struct rcar_du_gem_backing *
+rcar_du_gem_backing_alloc(struct drm_device *dev, size_t size, bool paged)
+{
+	struct rcar_du_gem_backing *backing;
+	unsigned int num_pages = size >> PAGE_SHIFT;
+	unsigned int i;
+	int ret;
+
+	backing = kzalloc(sizeof(*backing), GFP_KERNEL);
+	if (!backing)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&backing->list);
+	backing->size = size;
+
+	if (!paged) {
+		backing->vaddr = dma_alloc_wc(dev->dev, size, &backing->paddr,
+					      GFP_KERNEL | __GFP_NOWARN);
+		if (!backing->vaddr) {
+			dev_dbg(dev->dev, "failed to allocate buffer with size %zu\n",
+				size);
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		return backing;
+	}
+
+	backing->pages = kvcalloc(num_pages, sizeof(*backing->pages),
+				  GFP_KERNEL);
+	if (!backing->pages) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	for (i = 0; i < num_pages; ++i) {
+		backing->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!backing->pages[i]) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	backing->sgt = drm_prime_pages_to_sg(dev, backing->pages, num_pages);
+	if (IS_ERR(backing->sgt)) {
+		ret = PTR_ERR(backing->sgt);
+		backing->sgt = NULL;
+		goto error;
+	}
+
+	/* Mapping the pages cleans the CPU caches. */
+	ret = dma_map_sgtable(dev->dev, backing->sgt, DMA_TO_DEVICE, 0);
+	if (ret)
+		goto error;
+
+	backing->mapped = true;
+
+	return backing;
+
+error:
+	rcar_du_gem_backing_free(dev, backing);
+	return ERR_PTR(ret);
+}
+
+static void rcar_du_gem_backing_zero(struct drm_device *dev,
+				     struct rcar_du_gem_backing *backing)
+{
+	unsigned int num_pages = backing->size >> PAGE_SHIFT;
+	unsigned int i;
+
+	if (backing->vaddr) {
+		memset(backing->vaddr, 0, backing->size);
+		return;
+	}
+
+	for (i = 0; i < num_pages; ++i) {
+		clear_highpage(backing->pages[i]);
+		cond_resched();
+	}
+
+	rcar_du_gem_backing_clean(dev, backing);
+}
+
+/* -----------------------------------------------------------------------------
+ * Backing Stores Pool
+ *
+ * Backing stores of freed dumb GEM objects are kept in a per-device pool to be
+ * reused by new objects, avoiding the allocation cost when clients create and
+ * destroy buffers repeatedly. Released backing stores are zeroed asynchronously
+ * by a work item before being made available, so that allocation never pays
+ * the zeroing cost and buffer contents never leak between clients. The total
+ * pool size is capped, and a shrinker releases pooled memory under pressure.
+ */
+
+#define RCAR_DU_GEM_POOL_MAX_SIZE	SZ_64M
+
+/*
+ * Backing stores are bucketed by the order of their number of pages, and are
+ * reused for objects of the same order that fit in them.
+ */
+static unsigned int rcar_du_gem_pool_bucket(size_t size)
+{
+	return min_t(unsigned int, order_base_2(size >> PAGE_SHIFT),
+		     RCAR_DU_GEM_POOL_BUCKETS - 1);
+}
+
+static struct rcar_du_gem_backing *
+rcar_du_gem_pool_get(struct rcar_du_gem_pool *pool, size_t size)
+{
+	struct list_head *bucket = &pool->clean[rcar_du_gem_pool_bucket(size)];
+	struct rcar_du_gem_backing *backing;
+
+	mutex_lock(&pool->lock);
+
+	list_for_each_entry(backing, bucket, list) {
+		if (backing->size >= size) {
+			list_del_init(&backing->list);
+			pool->size -= backing->size;
+			mutex_unlock(&pool->lock);
+			return backing;
+		}
+	}
+
+	mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static bool rcar_du_gem_pool_put(struct rcar_du_gem_pool *pool,
+				 struct rcar_du_gem_backing *backing)
+{
+	mutex_lock(&pool->lock);
+
+	if (pool->dying ||
+	    pool->size + backing->size > RCAR_DU_GEM_POOL_MAX_SIZE) {
+		mutex_unlock(&pool->lock);
+		return false;
+	}
+
+	list_add_tail(&backing->list, &pool->dirty);
+	pool->size += backing->size;
+
+	mutex_unlock(&pool->lock);
+
+	queue_work(system_unbound_wq, &pool->zero_work);
+
+	return true;
+}
+
+static void rcar_du_gem_pool_zero_work(struct work_struct *work)
+{
+	struct rcar_du_gem_pool *pool =
+		container_of(work, struct rcar_du_gem_pool, zero_work);
+	struct rcar_du_gem_backing *backing;
+
+	while (1) {
+		mutex_lock(&pool->lock);
+		backing = list_first_entry_or_null(&pool->dirty,
+						   struct rcar_du_gem_backing,
+						   list);
+		if (backing) {
+			list_del_init(&backing->list);
+			pool->size -= backing->size;
+		}
+		mutex_unlock(&pool->lock);
+
+		if (!backing)
+			break;
+
+		rcar_du_gem_backing_zero(pool->dev, backing);
+
+		mutex_lock(&pool->lock);
+		list_add_tail(&backing->list,
+			      &pool->clean[rcar_du_gem_pool_bucket(backing->size)]);
+		pool->size += backing->size;
+		mutex_unlock(&pool->lock);
+	}
+}
+
+static unsigned long rcar_du_gem_pool_count(struct shrinker *shrinker,
+					    struct shrink_control *sc)
+{
+	struct rcar_du_gem_pool *pool =
+		container_of(shrinker, struct rcar_du_gem_pool, shrinker);
+	size_t size = READ_ONCE(pool->size);
+
+	return size ? size >> PAGE_SHIFT : SHRINK_EMPTY;
+}
+
+static unsigned long rcar_du_gem_pool_scan(struct shrinker *shrinker,
+					   struct shrink_control *sc)
+{
+	struct rcar_du_gem_pool *pool =
+		container_of(shrinker, struct rcar_du_gem_pool, shrinker);
+	struct rcar_du_gem_backing *backing, *next;
+	unsigned long freed = 0;
+	LIST_HEAD(list);
+	unsigned int i;
+
+	if (!mutex_trylock(&pool->lock))
+		return SHRINK_STOP;
+
+	/* Release the dirty backing stores first, then the largest ones. */
+	list_for_each_entry_safe(backing, next, &pool->dirty, list) {
+		if (freed >= sc->nr_to_scan)
+			break;
+
+		list_move(&backing->list, &list);
+		pool->size -= backing->size;
+		freed += backing->size >> PAGE_SHIFT;
+	}
+
+	for (i = RCAR_DU_GEM_POOL_BUCKETS; i > 0; --i) {
+		list_for_each_entry_safe(backing, next, &pool->clean[i - 1],
+					 list) {
+			if (freed >= sc->nr_to_scan)
+				break;
+
+			list_move(&backing->list, &list);
+			pool->size -= backing->size;
+			freed += backing->size >> PAGE_SHIFT;
+		}
+	}
+
+	mutex_unlock(&pool->lock);
+
+	list_for_each_entry_safe(backing, next, &list, list)
+		rcar_du_gem_backing_free(pool->dev, backing);
+
+	return freed;
+}
+
+static void rcar_du_gem_pool_cleanup(struct drm_device *dev, void *res)
+{
+	struct rcar_du_gem_pool *pool = res;
+	struct rcar_du_gem_backing *backing, *next;
+	LIST_HEAD(list);
+	unsigned int i;
+
+	/*
+	 * GEM objects can outlive the pool when they are still referenced
+	 * through dma-bufs. Stop accepting backing stores, they are then freed
+	 * directly, and keep the pool lock and lists usable.
+	 */
+	mutex_lock(&pool->lock);
+	pool->dying = true;
+	mutex_unlock(&pool->lock);
+
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->zero_work);
+
+	mutex_lock(&pool->lock);
+	list_splice_init(&pool->dirty, &list);
+	for (i = 0; i < RCAR_DU_GEM_POOL_BUCKETS; ++i)
+		list_splice_init(&pool->clean[i], &list);
+	pool->size = 0;
+	mutex_unlock(&pool->lock);
+
+	list_for_each_entry_safe(backing, next, &list, list)
+		rcar_du_gem_backing_free(dev, backing);
+}
+
+int rcar_du_gem_pool_init(struct rcar_du_device *rcdu)
+{
+	struct rcar_du_gem_pool *pool = &rcdu->gem_pool;
+	unsigned int i;
+	int ret;
+
+	pool->dev = rcdu->ddev;
+	mutex_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->dirty);
+	for (i = 0; i < RCAR_DU_GEM_POOL_BUCKETS; ++i)
+		INIT_LIST_HEAD(&pool->clean[i]);
+	INIT_WORK(&pool->zero_work, rcar_du_gem_pool_zero_work);
+
+	pool->shrinker.count_objects = rcar_du_gem_pool_count;
+	pool->shrinker.scan_objects = rcar_du_gem_pool_scan;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+
+	ret = register_shrinker(&pool->shrinker);
+	if (ret < 0) {
+		mutex_destroy(&pool->lock);
+		return ret;
+	}
+
+	return drmm_add_action_or_reset(rcdu->ddev, rcar_du_gem_pool_cleanup,
+					pool);
+}
+
+/* -----------------------------------------------------------------------------
+ * GEM Objects
+ */
+
+static const struct vm_operations_struct rcar_du_gem_vm_ops = {
+	.open = drm_gem_vm_open,
+	.close = drm_gem_vm_close,
+};
+
+static void rcar_du_gem_free_object(struct drm_gem_object *obj)
+{
+	struct rcar_du_gem_object *robj = to_rcar_gem_object(obj);
+	struct rcar_du_device *rcdu = obj->dev->dev_private;
+
+	if (!rcar_du_gem_pool_put(&rcdu->gem_pool, robj->backing))
+		rcar_du_gem_backing_free(obj->dev, robj->backing);
+
+	drm_gem_object_release(obj);
+	kfree(robj);
+}
+
+static struct sg_table *rcar_du_gem_get_sg_table(struct drm_gem_object *obj)
+{
+	struct rcar_du_gem_object *robj = to_rcar_gem_object(obj);
+
+	return drm_prime_pages_to_sg(obj->dev, robj->backing->pages,
+				     obj->size >> PAGE_SHIFT);
+}
+
+static void *rcar_du_gem_vmap(struct drm_gem_object *obj)
+{
+	struct rcar_du_gem_object *robj = to_rcar_gem_object(obj);
+
+	return vmap(robj->backing->pages, obj->size >> PAGE_SHIFT, VM_MAP,
+		    robj->cached ? PAGE_KERNEL
+				 : pgprot_writecombine(PAGE_KERNEL));
+}
+
+static void rcar_du_gem_vunmap(struct drm_gem_object *obj, void *vaddr)
+{
+	vunmap(vaddr);
+}
+
+static int rcar_du_gem_object_mmap(struct drm_gem_object *obj,
+				   struct vm_area_struct *vma)
+{
+	struct rcar_du_gem_object *robj = to_rcar_gem_object(obj);
+
+	vma->vm_ops = &rcar_du_gem_vm_ops;
+	vma->vm_flags &= ~VM_PFNMAP;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+	if (!robj->cached)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+	return vm_map_pages(vma, robj->backing->pages, obj->size >> PAGE_SHIFT);
+}
+
+static const struct drm_gem_object_funcs rcar_du_gem_paged_funcs = {
+	.free = rcar_du_gem_free_object,
+	.get_sg_table = rcar_du_gem_get_sg_table,
+	.vmap = rcar_du_gem_vmap,
+	.vunmap = rcar_du_gem_vunmap,
+	.mmap = rcar_du_gem_object_mmap,
+	.vm_ops = &rcar_du_gem_vm_ops,
+};
+
+static const struct drm_gem_object_funcs rcar_du_gem_contig_funcs = {
+	.free = rcar_du_gem_free_object,
+	.print_info = drm_gem_cma_print_info,
+	.get_sg_table = drm_gem_cma_prime_get_sg_table,
+	.vmap = drm_gem_cma_prime_vmap,
+	.vunmap = drm_gem_cma_prime_vunmap,
+	.vm_ops = &drm_gem_cma_vm_ops,
+};
+
+bool rcar_du_gem_is_paged(struct drm_gem_object *obj)
+{
+	return obj->funcs == &rcar_du_gem_paged_funcs;
+}
+
+bool rcar_du_gem_is_cached(struct drm_gem_object *obj)
+{
+	return rcar_du_gem_is_paged(obj) && to_rcar_gem_object(obj)->cached;
+}
+
+/*
+ * The VSP maps buffers without CPU cache synchronization, clean the CPU caches
+ * of objects mapped cached before the VSP reads them.
+ */
+void rcar_du_gem_sync_for_device(struct drm_gem_object *obj)
+{
+	if (!rcar_du_gem_is_cached(obj))
+		return;
+
+	rcar_du_gem_backing_clean(obj->dev, to_rcar_gem_object(obj)->backing);
+}
+
+static struct rcar_du_gem_object *
+rcar_du_gem_create(struct drm_device *dev, size_t size, bool cached)
+{
+	struct rcar_du_device *rcdu = dev->dev_private;
+	struct rcar_du_gem_backing *backing;
+	struct rcar_du_gem_object *robj;
+	struct drm_gem_object *obj;
+	int ret;
+
+	size = PAGE_ALIGN(size);
+
+	backing = rcar_du_gem_pool_get(&rcdu->gem_pool, size);
+	if (!backing) {
+		backing = rcar_du_gem_backing_alloc(dev, size,
+						    rcdu->paged_buffers);
+		if (IS_ERR(backing))
+			return ERR_CAST(backing);
+	}
+
+	robj = kzalloc(sizeof(*robj), GFP_KERNEL);
+	if (!robj) {
+		rcar_du_gem_backing_free(dev, backing);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	robj->backing = backing;
+	robj->cached = backing->pages && cached;
+	robj->cma.sgt = backing->sgt;
+	robj->cma.vaddr = backing->vaddr;
+	robj->cma.paddr = backing->paddr;
+
+	obj = &robj->cma.base;
+	obj->funcs = backing->pages ? &rcar_du_gem_paged_funcs
+		   : &rcar_du_gem_contig_funcs;
+	drm_gem_private_object_init(dev, obj, backing->size);
+
+	ret = drm_gem_create_mmap_offset(obj);
+	if (ret) {
+		drm_gem_object_put(obj);
+		return ERR_PTR(ret);
+	}
+
+	return robj;
+}
+
+int rcar_du_gem_dumb_create(struct drm_file *file, struct drm_device *dev,
+			    struct drm_mode_create_dumb *args)
+{
+	struct rcar_du_gem_object *robj;
+	int ret;
+
+	args->size = args->pitch * args->height;
+
+	/*
+	 * Paged buffers can be mapped cached on request. In-kernel clients such
+	 * as fbdev create their buffers without flags and get write-combined
+	 * mappings, as they don't synchronize the CPU caches.
+	 */
+	robj = rcar_du_gem_create(dev, args->size,
+				  args->flags & RCAR_DU_DUMB_CACHED);
+	if (IS_ERR(robj))
+		return PTR_ERR(robj);
+
+	ret = drm_gem_handle_create(file, &robj->cma.base, &args->handle);
+	drm_gem_object_put(&robj->cma.base);
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * mmap
+ */
+
+int rcar_du_gem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct drm_gem_cma_object *cma_obj;
+	struct drm_gem_object *obj;
+	int ret;
+
+	ret = drm_gem_mmap(filp, vma);
+	if (ret)
+		return ret;
+
+	/* Paged objects are mapped by rcar_du_gem_object_mmap(). */
+	obj = vma->vm_private_data;
+	if (rcar_du_gem_is_paged(obj))
+		return 0;
+
+	/*
+	 * Map contiguous objects the same way as drm_gem_cma_mmap(). Clear the
+	 * VM_PFNMAP flag that was set by drm_gem_mmap_obj() and reset the fake
+	 * offset used by the DRM core.
+	 */
+	cma_obj = to_drm_gem_cma_obj(obj);
+
+	vma->vm_flags &= ~VM_PFNMAP;
+	vma->vm_pgoff = 0;
+
+	ret = dma_mmap_wc(cma_obj->base.dev->dev, vma, cma_obj->vaddr,
+			  cma_obj->paddr, vma->vm_end - vma->vm_start);
+	if (ret)
+		drm_gem_vm_close(vma);
+
+	return ret;
+}
+
+int rcar_du_gem_prime_mmap(struct drm_gem_object *obj,
+			   struct vm_area_struct *vma)
+{
+	if (rcar_du_gem_is_paged(obj))
+		return drm_gem_prime_mmap(obj, vma);
+
+	return drm_gem_cma_prime_mmap(obj, vma);
+}
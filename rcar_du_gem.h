@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * rcar_du_gem.h  --  R-Car Display Unit GEM Objects
+ *
+ * Copyright (C) 2013-2018 Renesas Electronics Corporation
+ *
+ * Contact: Laurent Pinchart (laurent.pinchart@ideasonboard.com)
+ */
+
+#ifndef __RCAR_DU_GEM_H__
+#define __RCAR_DU_GEM_H__
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+
+#include <drm/drm_gem_cma_helper.h>
+
+struct drm_device;
+struct drm_file;
+struct drm_mode_create_dumb;
+struct file;
+struct page;
+struct rcar_du_device;
+struct sg_table;
+struct vm_area_struct;
+
+/**
+ * struct rcar_du_gem_backing - Memory backing a dumb GEM object
+ * @list: entry in the pool lists when the backing store is pooled
+ * @size: size of the memory in bytes
+ * @pages: array of pages (paged backing stores only)
+ * @sgt: scatter-gather table describing the pages (paged backing stores only)
+ * @vaddr: kernel virtual address (contiguous backing stores only)
+ * @paddr: DMA address (contiguous backing stores only)
+ * @mapped: true if @sgt is mapped to the DU device
+ */
+struct rcar_du_gem_backing {
+	struct list_head list;
+	size_t size;
+
+	struct page **pages;
+	struct sg_table *sgt;
+
+	void *vaddr;
+	dma_addr_t paddr;
+
+	bool mapped;
+};
+
+/**
+ * struct rcar_du_gem_object - Dumb GEM object
+ * @cma: base CMA GEM object
+ * @backing: memory backing the object
+ * @cached: true if the CPU maps the object cached
+ *
+ * Dumb GEM objects embed a CMA GEM object to be handled transparently by the
+ * CMA framebuffer helpers. They are backed either by contiguous DMA memory, or
+ * by pages when all the VSPs access memory through an IOMMU and can thus scan
+ * out physically non-contiguous memory. Paged objects have a NULL physical
+ * address and a scatter-gather table describing the pages, in the same way as
+ * imported dma-bufs.
+ *
+ * Paged objects are mapped write-combined by default. When created with the
+ * RCAR_DU_DUMB_CACHED flag they are mapped cached, and the CPU caches are
+ * cleaned before the VSP reads them, in .prepare_fb() and on DIRTYFB.
+ */
+struct rcar_du_gem_object {
+	struct drm_gem_cma_object cma;
+	struct rcar_du_gem_backing *backing;
+	bool cached;
+};
+
+#define to_rcar_gem_object(obj) \
+	container_of(obj, struct rcar_du_gem_object, cma.base)
+
+#define RCAR_DU_GEM_POOL_BUCKETS	16
+
+/**
+ * struct rcar_du_gem_pool - Pool of recycled dumb GEM backing stores
+ * @dev: the DRM device
+ * @lock: protects the lists and the pool size
+ * @dirty: backing stores waiting to be zeroed
+ * @clean: zeroed backing stores ready for reuse, bucketed by size order
+ * @size: total size of the pooled backing stores in bytes
+ * @zero_work: work zeroing the dirty backing stores
+ * @shrinker: shrinker releasing pooled backing stores under memory pressure
+ * @dying: the pool has been shut down, backing stores are freed directly
+ */
+struct rcar_du_gem_pool {
+	struct drm_device *dev;
+	struct mutex lock;
+	struct list_head dirty;
+	struct list_head clean[RCAR_DU_GEM_POOL_BUCKETS];
+	size_t size;
+	struct work_struct zero_work;
+	struct shrinker shrinker;
+	bool dying;
+};
+
+int rcar_du_gem_pool_init(struct rcar_du_device *rcdu);
+
+bool rcar_du_gem_is_paged(struct drm_gem_object *obj);
+bool rcar_du_gem_is_cached(struct drm_gem_object *obj);
+void rcar_du_gem_sync_for_device(struct drm_gem_object *obj);
+
+int rcar_du_gem_dumb_create(struct drm_file *file, struct drm_device *dev,
+			    struct drm_mode_create_dumb *args);
+
+int rcar_du_gem_mmap(struct file *filp, struct vm_area_struct *vma);
+int rcar_du_gem_prime_mmap(struct drm_gem_object *obj,
+			   struct vm_area_struct *vma);
+
+#endif /* __RCAR_DU_GEM_H__ */
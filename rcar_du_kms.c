@@ -21,12 +21,15 @@
 #include <linux/device.h>
 #include <linux/of_graph.h>
 #include <linux/of_platform.h>
+#include <linux/slab.h>
 #include <linux/wait.h>
 
 #include "rcar_du_crtc.h"
 #include "rcar_du_drv.h"
 #include "rcar_du_encoder.h"
+#include "rcar_du_gem.h"
 #include "rcar_du_kms.h"
+#include "rcar_du_plane.h"
 #include "rcar_du_regs.h"
 #include "rcar_du_vsp.h"
 #include "rcar_du_writeback.h"
@@ -339,6 +342,66 @@ const struct rcar_du_format_info *rcar_du_format_info(u32 fourcc)
 	return NULL;
 }
 
+/* -----------------------------------------------------------------------------
+ * State caches
+ *
+ * CRTC, plane and writeback connector states are duplicated and destroyed for
+ * every object touched by every atomic commit. Allocate them from dedicated
+ * slab caches to make the allocations cheaper and to make their footprint
+ * visible in /proc/slabinfo.
+ */
+
+struct kmem_cache *rcar_du_crtc_state_cache;
+struct kmem_cache *rcar_du_plane_state_cache;
+struct kmem_cache *rcar_du_vsp_plane_state_cache;
+struct kmem_cache *rcar_du_vsp_fb_map_cache;
+struct kmem_cache *rcar_du_wb_conn_state_cache;
+
+int rcar_du_kms_init_caches(void)
+{
+	rcar_du_crtc_state_cache = KMEM_CACHE(rcar_du_crtc_state, 0);
+	if (!rcar_du_crtc_state_cache)
+		goto error;
+
+	rcar_du_plane_state_cache = KMEM_CACHE(rcar_du_plane_state, 0);
+	if (!rcar_du_plane_state_cache)
+		goto error;
+
+	rcar_du_vsp_plane_state_cache = KMEM_CACHE(rcar_du_vsp_plane_state, 0);
+	if (!rcar_du_vsp_plane_state_cache)
+		goto error;
+
+	rcar_du_vsp_fb_map_cache = KMEM_CACHE(rcar_du_vsp_fb_map, 0);
+	if (!rcar_du_vsp_fb_map_cache)
+		goto error;
+
+	rcar_du_wb_conn_state_cache = KMEM_CACHE(rcar_du_wb_conn_state, 0);
+	if (!rcar_du_wb_conn_state_cache)
+		goto error;
+
+	return 0;
+
+error:
+	rcar_du_kms_destroy_caches();
+	return -ENOMEM;
+}
+
+void rcar_du_kms_destroy_caches(void)
+{
+	/* kmem_cache_destroy() is a no-op for NULL caches. */
+	kmem_cache_destroy(rcar_du_wb_conn_state_cache);
+	kmem_cache_destroy(rcar_du_vsp_fb_map_cache);
+	kmem_cache_destroy(rcar_du_vsp_plane_state_cache);
+	kmem_cache_destroy(rcar_du_plane_state_cache);
+	kmem_cache_destroy(rcar_du_crtc_state_cache);
+
+	rcar_du_wb_conn_state_cache = NULL;
+	rcar_du_vsp_fb_map_cache = NULL;
+	rcar_du_vsp_plane_state_cache = NULL;
+	rcar_du_plane_state_cache = NULL;
+	rcar_du_crtc_state_cache = NULL;
+}
+
 /* -----------------------------------------------------------------------------
  * Frame buffer
  */
@@ -399,7 +462,60 @@ int rcar_du_dumb_create(struct drm_file *file, struct drm_device *dev,
 
 	args->pitch = roundup(min_pitch, align);
 
-	return drm_gem_cma_dumb_create_internal(file, dev, args);
+	return rcar_du_gem_dumb_create(file, dev, args);
+}
+
+static int rcar_du_fb_dirty(struct drm_framebuffer *fb,
+			    struct drm_file *file_priv, unsigned int flags,
+			    unsigned int color, struct drm_clip_rect *clips,
+			    unsigned int num_clips)
+{
+	unsigned int i;
+
+	for (i = 0; i < fb->format->num_planes; ++i)
+		rcar_du_gem_sync_for_device(fb->obj[i]);
+
+	return 0;
+}
+
+static const struct drm_framebuffer_funcs rcar_du_fb_funcs = {
+	.destroy = drm_gem_fb_destroy,
+	.create_handle = drm_gem_fb_create_handle,
+};
+
+/*
+ * Clients rendering to the front buffer report the rendering with DIRTYFB
+ * without going through .prepare_fb(), the CPU caches of cached objects are
+ * cleaned there. Framebuffers of write-combined objects don't implement
+ * .dirty(), which would otherwise make fbdev use a shadow buffer.
+ */
+static const struct drm_framebuffer_funcs rcar_du_fb_cached_funcs = {
+	.destroy = drm_gem_fb_destroy,
+	.create_handle = drm_gem_fb_create_handle,
+	.dirty = rcar_du_fb_dirty,
+};
+
+static const struct drm_framebuffer_funcs *
+rcar_du_fb_get_funcs(struct drm_file *file_priv,
+		     const struct drm_mode_fb_cmd2 *mode_cmd,
+		     unsigned int num_planes)
+{
+	bool cached = false;
+	unsigned int i;
+
+	for (i = 0; i < num_planes; ++i) {
+		struct drm_gem_object *obj;
+
+		/* Invalid handles are rejected when creating the framebuffer. */
+		obj = drm_gem_object_lookup(file_priv, mode_cmd->handles[i]);
+		if (!obj)
+			continue;
+
+		cached |= rcar_du_gem_is_cached(obj);
+		drm_gem_object_put(obj);
+	}
+
+	return cached ? &rcar_du_fb_cached_funcs : &rcar_du_fb_funcs;
 }
 
 static struct drm_framebuffer *
@@ -407,6 +523,7 @@ rcar_du_fb_create(struct drm_device *dev, struct drm_file *file_priv,
 		  const struct drm_mode_fb_cmd2 *mode_cmd)
 {
 	struct rcar_du_device *rcdu = dev->dev_private;
+	const struct drm_framebuffer_funcs *funcs;
 	const struct rcar_du_format_info *format;
 	unsigned int chroma_pitch;
 	unsigned int max_pitch;
@@ -451,6 +568,27 @@ rcar_du_fb_create(struct drm_device *dev, struct drm_file *file_priv,
 		return ERR_PTR(-EINVAL);
 	}
 
+	if (rcdu->info->gen >= 3) {
+		/*
+		 * The VSP RPF has independent luma and chroma strides, but a
+		 * single chroma stride shared by the U and V planes. The
+		 * minimum pitch of each plane is checked by the DRM core.
+		 */
+		for (i = 1; i < format->planes; ++i) {
+			if (mode_cmd->pitches[i] > max_pitch ||
+			    mode_cmd->pitches[i] != mode_cmd->pitches[1]) {
+				dev_dbg(dev->dev, "invalid chroma pitch value %u\n",
+					mode_cmd->pitches[i]);
+				return ERR_PTR(-EINVAL);
+			}
+		}
+
+		funcs = rcar_du_fb_get_funcs(file_priv, mode_cmd,
+					     format->planes);
+		return drm_gem_fb_create_with_funcs(dev, file_priv, mode_cmd,
+						    funcs);
+	}
+
 	/*
 	 * Calculate the chroma plane(s) pitch using the horizontal subsampling
 	 * factor. For semi-planar formats, the U and V planes are combined, the
@@ -486,7 +624,7 @@ static int rcar_du_atomic_check(struct drm_device *dev,
 		return ret;
 
 	if (rcar_du_has(rcdu, RCAR_DU_FEATURE_VSP1_SOURCE))
-		return 0;
+		return rcar_du_vsp_atomic_check(dev, state);
 
 	return rcar_du_atomic_check_planes(dev, state);
 }
@@ -505,6 +643,10 @@ static void rcar_du_atomic_commit_tail(struct drm_atomic_state *old_state)
 	 */
 	rcdu->dpad1_source = -1;
 
+	/* The plane in-fences have been waited for, account for late ones. */
+	if (rcar_du_has(rcdu, RCAR_DU_FEATURE_VSP1_SOURCE))
+		rcar_du_vsp_account_fences(old_state);
+
 	for_each_new_crtc_in_state(old_state, crtc, crtc_state, i) {
 		struct rcar_du_crtc_state *rcrtc_state =
 			to_rcar_crtc_state(crtc_state);
@@ -517,7 +659,27 @@ static void rcar_du_atomic_commit_tail(struct drm_atomic_state *old_state)
 			rcdu->dpad1_source = rcrtc->index;
 	}
 
-	/* Apply the atomic update. */
+	/*
+	 * Hold the update of running CRTCs until the vblank preceding their
+	 * target vblank, the new frame is then latched at the target vblank.
+	 */
+	for_each_new_crtc_in_state(old_state, crtc, crtc_state, i) {
+		if (!to_rcar_crtc_state(crtc_state)->has_target ||
+		    !crtc_state->active ||
+		    drm_atomic_crtc_needs_modeset(crtc_state))
+			continue;
+
+		rcar_du_crtc_wait_target_vblank(to_rcar_crtc(crtc),
+						crtc_state->target_vblank);
+	}
+
+	/*
+	 * Apply the atomic update. The CRTCs are flushed back to back, but each
+	 * DU channel runs its own timing generator and each VSP latches its new
+	 * display list at the frame boundary of its own channel. CRTCs updated
+	 * in the same commit can't be frame-locked, their new frames may be
+	 * latched at different vblanks.
+	 */
 	drm_atomic_helper_commit_modeset_disables(dev, old_state);
 	drm_atomic_helper_commit_planes(dev, old_state,
 					DRM_PLANE_COMMIT_ACTIVE_ONLY);
@@ -544,7 +706,12 @@ int rcar_du_async_commit(struct drm_device *dev, struct drm_crtc *crtc)
 		goto err;
 	}
 
-	crtc_state = drm_atomic_helper_crtc_duplicate_state(crtc);
+	/*
+	 * Use the driver duplicate handler, the resulting state is destroyed
+	 * through rcar_du_crtc_atomic_destroy_state() and must thus be a
+	 * struct rcar_du_crtc_state allocated from the CRTC state cache.
+	 */
+	crtc_state = crtc->funcs->atomic_duplicate_state(crtc);
 	if (!crtc_state) {
 		ret = -ENOMEM;
 		goto err;
@@ -695,6 +862,39 @@ static int rcar_du_properties_init(struct rcar_du_device *rcdu)
 			return -ENOMEM;
 	}
 
+	/*
+	 * The background color is expressed as an RGB888 triplet stored in a
+	 * 32-bit integer in XRGB8888 format. It fills the display area not
+	 * covered by any plane.
+	 */
+	rcdu->props.bgcolor =
+		drm_property_create_range(rcdu->ddev, 0, "bgcolor",
+					  0, 0x00ffffff);
+	if (!rcdu->props.bgcolor)
+		return -ENOMEM;
+
+	/*
+	 * The target vblank is the absolute vblank count, modulo 2^32, at which
+	 * the commit should take effect. 0 targets the next vblank, and 2^32
+	 * targets vblank 0. Unlike the legacy page flip target it isn't limited
+	 * to the next vblank, but can't be more than one second ahead.
+	 */
+	rcdu->props.target_vblank =
+		drm_property_create_range(rcdu->ddev, 0, "target_vblank",
+					  0, BIT_ULL(32));
+	if (!rcdu->props.target_vblank)
+		return -ENOMEM;
+
+	/*
+	 * The output is reported as frozen when its CRC stays identical for
+	 * the given number of consecutive frames, 0 disables the detector.
+	 */
+	rcdu->props.freeze_threshold =
+		drm_property_create_range(rcdu->ddev, 0, "freeze_threshold",
+					  0, U16_MAX);
+	if (!rcdu->props.freeze_threshold)
+		return -ENOMEM;
+
 	return 0;
 }
 
@@ -776,8 +976,11 @@ static int rcar_du_vsps_init(struct rcar_du_device *rcdu)
 
 	/*
 	 * Then initialize all the VSPs from the node pointers and CRTCs bitmask
-	 * computed previously.
+	 * computed previously. Dumb buffers can be allocated from pages only if
+	 * all VSPs access memory through an IOMMU.
 	 */
+	rcdu->paged_buffers = vsps_count > 0;
+
 	for (i = 0; i < vsps_count; ++i) {
 		struct rcar_du_vsp *vsp = &rcdu->vsps[i];
 
@@ -787,6 +990,9 @@ static int rcar_du_vsps_init(struct rcar_du_device *rcdu)
 		ret = rcar_du_vsp_init(vsp, vsps[i].np, vsps[i].crtcs_mask);
 		if (ret < 0)
 			goto error;
+
+		if (!vsp->iommu)
+			rcdu->paged_buffers = false;
 	}
 
 	return 0;
@@ -883,6 +1089,15 @@ int rcar_du_modeset_init(struct rcar_du_device *rcdu)
 	unsigned int i;
 	int ret;
 
+	/*
+	 * Initialize the GEM backing stores pool first, managed resources are
+	 * released in reverse order and the pool must outlive the framebuffers
+	 * released by the mode config cleanup.
+	 */
+	ret = rcar_du_gem_pool_init(rcdu);
+	if (ret < 0)
+		return ret;
+
 	ret = drmm_mode_config_init(dev);
 	if (ret)
 		return ret;
@@ -899,12 +1114,19 @@ int rcar_du_modeset_init(struct rcar_du_device *rcdu)
 	} else {
 		/*
 		 * The Gen3 DU uses the VSP1 for memory access, and is limited
-		 * to frame sizes of 8190x8190.
+		 * to frame sizes of 8190x8190. Planes only fetch their source
+		 * rectangle from memory, framebuffers can thus be larger and
+		 * be scanned out by multiple CRTCs. Their width is limited by
+		 * the 65535 bytes pitch of the RPF.
 		 */
-		dev->mode_config.max_width = 8190;
-		dev->mode_config.max_height = 8190;
+		dev->mode_config.max_width = 16383;
+		dev->mode_config.max_height = 16383;
 	}
 
+	/* Asynchronous page flips are implemented as mailbox flips. */
+	if (rcar_du_has(rcdu, RCAR_DU_FEATURE_VSP1_SOURCE))
+		dev->mode_config.async_page_flip = true;
+
 	rcdu->num_crtcs = hweight8(rcdu->info->channels_mask);
 	rcdu->vspdl_fix = false;
 	rcdu->brs_num = 0;
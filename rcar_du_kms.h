@@ -17,6 +17,7 @@ struct drm_file;
 struct drm_device;
 struct drm_gem_object;
 struct drm_mode_create_dumb;
+struct kmem_cache;
 struct rcar_du_device;
 struct sg_table;
 
@@ -32,6 +33,15 @@ struct rcar_du_format_info {
 
 const struct rcar_du_format_info *rcar_du_format_info(u32 fourcc);
 
+extern struct kmem_cache *rcar_du_crtc_state_cache;
+extern struct kmem_cache *rcar_du_plane_state_cache;
+extern struct kmem_cache *rcar_du_vsp_plane_state_cache;
+extern struct kmem_cache *rcar_du_vsp_fb_map_cache;
+extern struct kmem_cache *rcar_du_wb_conn_state_cache;
+
+int rcar_du_kms_init_caches(void);
+void rcar_du_kms_destroy_caches(void);
+
 int rcar_du_modeset_init(struct rcar_du_device *rcdu);
 
 int rcar_du_dumb_create(struct drm_file *file, struct drm_device *dev,
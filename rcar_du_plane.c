@@ -16,6 +16,8 @@
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_plane_helper.h>
 
+#include <linux/slab.h>
+
 #include "rcar_du_drv.h"
 #include "rcar_du_group.h"
 #include "rcar_du_kms.h"
@@ -690,10 +692,12 @@ rcar_du_plane_atomic_duplicate_state(struct drm_plane *plane)
 		return NULL;
 
 	state = to_rcar_plane_state(plane->state);
-	copy = kmemdup(state, sizeof(*state), GFP_KERNEL);
+	copy = kmem_cache_alloc(rcar_du_plane_state_cache, GFP_KERNEL);
 	if (copy == NULL)
 		return NULL;
 
+	*copy = *state;
+
 	__drm_atomic_helper_plane_duplicate_state(plane, &copy->state);
 
 	return &copy->state;
@@ -703,7 +707,7 @@ static void rcar_du_plane_atomic_destroy_state(struct drm_plane *plane,
 					       struct drm_plane_state *state)
 {
 	__drm_atomic_helper_plane_destroy_state(state);
-	kfree(to_rcar_plane_state(state));
+	kmem_cache_free(rcar_du_plane_state_cache, to_rcar_plane_state(state));
 }
 
 static void rcar_du_plane_reset(struct drm_plane *plane)
@@ -715,7 +719,7 @@ static void rcar_du_plane_reset(struct drm_plane *plane)
 		plane->state = NULL;
 	}
 
-	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	state = kmem_cache_zalloc(rcar_du_plane_state_cache, GFP_KERNEL);
 	if (state == NULL)
 		return;
 
@@ -7,7 +7,9 @@
  * Contact: Laurent Pinchart (laurent.pinchart@ideasonboard.com)
  */
 
+#include <drm/drm_atomic.h>
 #include <drm/drm_atomic_helper.h>
+#include <drm/drm_blend.h>
 #include <drm/drm_crtc.h>
 #include <drm/drm_fb_cma_helper.h>
 #include <drm/drm_fourcc.h>
@@ -19,9 +21,13 @@
 #include <drm/rcar_du_drm.h>
 
 #include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/dma-fence.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-resv.h>
 #include <linux/of_platform.h>
 #include <linux/scatterlist.h>
+#include <linux/slab.h>
 #include <linux/videodev2.h>
 
 #include <media/vsp1.h>
@@ -31,6 +37,9 @@
 #include "rcar_du_vsp.h"
 #include "rcar_du_writeback.h"
 
+static void rcar_du_vsp_mailbox_complete(struct rcar_du_crtc *crtc,
+					 bool stopped);
+
 static void rcar_du_vsp_complete(void *private, unsigned int status, u32 crc)
 {
 	struct rcar_du_crtc *crtc = private;
@@ -38,12 +47,15 @@ static void rcar_du_vsp_complete(void *private, unsigned int status, u32 crc)
 	if (crtc->vblank_enable)
 		drm_crtc_handle_vblank(&crtc->crtc);
 
-	if (status & VSP1_DU_STATUS_COMPLETE)
+	if (status & VSP1_DU_STATUS_COMPLETE) {
 		rcar_du_crtc_finish_page_flip(crtc);
+		rcar_du_vsp_mailbox_complete(crtc, false);
+	}
 	if (status & VSP1_DU_STATUS_WRITEBACK)
 		rcar_du_writeback_complete(crtc);
 
-	drm_crtc_add_crc_entry(&crtc->crtc, false, 0, &crc);
+	rcar_du_crtc_crc_complete(crtc, status & VSP1_DU_STATUS_COMPLETE, crc);
+	rcar_du_crtc_freeze_check(crtc, crc);
 }
 
 void rcar_du_vsp_enable(struct rcar_du_crtc *crtc)
@@ -101,6 +113,15 @@ void rcar_du_vsp_enable(struct rcar_du_crtc *crtc)
 void rcar_du_vsp_disable(struct rcar_du_crtc *crtc)
 {
 	vsp1_du_setup_lif(crtc->vsp->vsp, crtc->vsp_pipe, NULL);
+
+	/*
+	 * The VSP doesn't read any framebuffer anymore, complete the pending
+	 * mailbox flips and release the framebuffers they replaced.
+	 */
+	rcar_du_vsp_mailbox_complete(crtc, true);
+	flush_work(&crtc->mailbox.release_work);
+
+	rcar_du_writeback_release_cache(crtc);
 }
 
 void rcar_du_vsp_atomic_begin(struct rcar_du_crtc *crtc)
@@ -108,16 +129,83 @@ void rcar_du_vsp_atomic_begin(struct rcar_du_crtc *crtc)
 	vsp1_du_atomic_begin(crtc->vsp->vsp, crtc->vsp_pipe);
 }
 
+/*
+ * Select the CRC source of the display list being flushed. The rotating source
+ * moves to the next visible plane of the CRTC, and falls back to the composer
+ * output when no plane is visible.
+ */
+static void rcar_du_vsp_setup_crc(struct rcar_du_crtc *crtc,
+				  const struct rcar_du_crtc_state *state,
+				  struct vsp1_du_crc_config *crc)
+{
+	struct drm_device *dev = crtc->crtc.dev;
+	struct rcar_du_vsp *vsp = crtc->vsp;
+	unsigned int start = 0;
+	unsigned long flags;
+	u32 plane_id = 0;
+	unsigned int i;
+
+	*crc = state->crc;
+
+	if (state->crc_rotate) {
+		for (i = 0; i < vsp->num_planes; ++i) {
+			struct drm_plane *plane = &vsp->planes[i].plane;
+
+			if (plane->base.id == crtc->crc_rotate.queued) {
+				start = i + 1;
+				break;
+			}
+		}
+
+		for (i = 0; i < vsp->num_planes; ++i) {
+			unsigned int index = (start + i) % vsp->num_planes;
+			struct drm_plane *plane = &vsp->planes[index].plane;
+
+			if (plane->state->crtc != &crtc->crtc ||
+			    !plane->state->visible)
+				continue;
+
+			crc->source = VSP1_DU_CRC_PLANE;
+			crc->index = index;
+			plane_id = plane->base.id;
+			break;
+		}
+
+		if (!plane_id)
+			crc->source = VSP1_DU_CRC_OUTPUT;
+	}
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	crtc->crc_rotate.enabled = state->crc_rotate;
+	crtc->crc_rotate.queued = plane_id;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+}
+
 void rcar_du_vsp_atomic_flush(struct rcar_du_crtc *crtc)
 {
 	struct vsp1_du_atomic_pipe_config cfg = { { 0, } };
+	struct drm_device *dev = crtc->crtc.dev;
 	struct rcar_du_crtc_state *state;
+	unsigned long flags;
 
 	state = to_rcar_crtc_state(crtc->crtc.state);
-	cfg.crc = state->crc;
+	rcar_du_vsp_setup_crc(crtc, state, &cfg.crc);
+
+	/*
+	 * The frozen frame detector monitors the output CRC unless a CRC source
+	 * has been selected through debugfs, in which case it monitors that
+	 * source.
+	 */
+	if (state->freeze_threshold && cfg.crc.source == VSP1_DU_CRC_NONE)
+		cfg.crc.source = VSP1_DU_CRC_OUTPUT;
+	cfg.bgcolor = state->bgcolor;
 
 	rcar_du_writeback_setup(crtc, &cfg.writeback);
 
+	spin_lock_irqsave(&dev->event_lock, flags);
+	crtc->mailbox.queued++;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
 	vsp1_du_atomic_flush(crtc->vsp->vsp, crtc->vsp_pipe, &cfg);
 }
 
@@ -152,6 +240,45 @@ static const u32 rcar_du_vsp_formats[] = {
 	DRM_FORMAT_YVU444,
 };
 
+/*
+ * Planes with the "None" pixel blend mode ignore the alpha component of their
+ * pixels, which is implemented by fetching them with the matching format
+ * without alpha.
+ */
+static u32 rcar_du_vsp_opaque_format(u32 fourcc)
+{
+	switch (fourcc) {
+	case DRM_FORMAT_ARGB1555:
+		return DRM_FORMAT_XRGB1555;
+	case DRM_FORMAT_ARGB4444:
+		return DRM_FORMAT_XRGB4444;
+	case DRM_FORMAT_ARGB8888:
+		return DRM_FORMAT_XRGB8888;
+	case DRM_FORMAT_ABGR1555:
+		return DRM_FORMAT_XBGR1555;
+	case DRM_FORMAT_ABGR4444:
+		return DRM_FORMAT_XBGR4444;
+	case DRM_FORMAT_ABGR8888:
+		return DRM_FORMAT_XBGR8888;
+	case DRM_FORMAT_BGRA4444:
+		return DRM_FORMAT_BGRX4444;
+	case DRM_FORMAT_BGRA5551:
+		return DRM_FORMAT_BGRX5551;
+	case DRM_FORMAT_BGRA8888:
+		return DRM_FORMAT_BGRX8888;
+	case DRM_FORMAT_RGBA4444:
+		return DRM_FORMAT_RGBX4444;
+	case DRM_FORMAT_RGBA5551:
+		return DRM_FORMAT_RGBX5551;
+	case DRM_FORMAT_RGBA8888:
+		return DRM_FORMAT_RGBX8888;
+	case DRM_FORMAT_ARGB2101010:
+		return DRM_FORMAT_XRGB2101010;
+	default:
+		return fourcc;
+	}
+}
+
 static void rcar_du_vsp_plane_setup(struct rcar_du_vsp_plane *plane)
 {
 	struct rcar_du_vsp_plane_state *state =
@@ -169,7 +296,12 @@ static void rcar_du_vsp_plane_setup(struct rcar_du_vsp_plane *plane)
 			((state->colorkey & RCAR_DU_COLORKEY_EN_MASK) != 0),
 		.colorkey_alpha =
 			(state->colorkey_alpha & RCAR_DU_COLORKEY_ALPHA_MASK),
+		.rotation = drm_rotation_simplify(state->state.rotation,
+						  RCAR_DU_VSP_ROTATIONS),
+		.premult = state->state.pixel_blend_mode ==
+			   DRM_MODE_BLEND_PREMULTI,
 	};
+	u32 fourcc = state->format->fourcc;
 	unsigned int i;
 
 	cfg.src.left = state->state.src.x1 >> 16;
@@ -183,10 +315,16 @@ static void rcar_du_vsp_plane_setup(struct rcar_du_vsp_plane *plane)
 	cfg.dst.height = drm_rect_height(&state->state.dst);
 
 	for (i = 0; i < state->format->planes; ++i)
-		cfg.mem[i] = sg_dma_address(state->sg_tables[i].sgl)
+		cfg.mem[i] = sg_dma_address(state->map->sg_tables[i].sgl)
 			   + fb->offsets[i];
 
-	format = rcar_du_format_info(state->format->fourcc);
+	if (state->format->planes > 1)
+		cfg.chroma_pitch = fb->pitches[1];
+
+	if (state->state.pixel_blend_mode == DRM_MODE_BLEND_PIXEL_NONE)
+		fourcc = rcar_du_vsp_opaque_format(fourcc);
+
+	format = rcar_du_format_info(fourcc);
 	cfg.pixelformat = format->v4l2;
 
 	vsp1_du_atomic_update(plane->vsp->vsp, crtc->vsp_pipe,
@@ -255,11 +393,133 @@ fail:
 	return ret;
 }
 
+/*
+ * Framebuffers are mapped once per VSP and the mapping is shared by all the
+ * planes of the VSP that display the framebuffer, including planes of the two
+ * VSPDL pipes scanning out different parts of a framebuffer spanning multiple
+ * CRTCs, and by writeback jobs. The mapping doesn't hold a reference to the
+ * framebuffer, its users do.
+ */
+struct rcar_du_vsp_fb_map *
+rcar_du_vsp_fb_map_get(struct rcar_du_vsp *vsp, struct drm_framebuffer *fb)
+{
+	struct rcar_du_vsp_fb_map *map;
+	int ret;
+
+	mutex_lock(&vsp->maps_lock);
+
+	list_for_each_entry(map, &vsp->maps, list) {
+		if (map->fb == fb) {
+			kref_get(&map->refcount);
+			goto done;
+		}
+	}
+
+	map = kmem_cache_zalloc(rcar_du_vsp_fb_map_cache, GFP_KERNEL);
+	if (!map) {
+		map = ERR_PTR(-ENOMEM);
+		goto done;
+	}
+
+	ret = rcar_du_vsp_map_fb(vsp, fb, map->sg_tables);
+	if (ret < 0) {
+		kmem_cache_free(rcar_du_vsp_fb_map_cache, map);
+		map = ERR_PTR(ret);
+		goto done;
+	}
+
+	kref_init(&map->refcount);
+	map->vsp = vsp;
+	map->fb = fb;
+	list_add_tail(&map->list, &vsp->maps);
+
+done:
+	mutex_unlock(&vsp->maps_lock);
+	return map;
+}
+
+static void rcar_du_vsp_fb_map_release(struct kref *ref)
+{
+	struct rcar_du_vsp_fb_map *map =
+		container_of(ref, struct rcar_du_vsp_fb_map, refcount);
+
+	list_del(&map->list);
+	mutex_unlock(&map->vsp->maps_lock);
+
+	rcar_du_vsp_unmap_fb(map->vsp, map->fb, map->sg_tables);
+	kmem_cache_free(rcar_du_vsp_fb_map_cache, map);
+}
+
+void rcar_du_vsp_fb_map_put(struct rcar_du_vsp_fb_map *map)
+{
+	kref_put_mutex(&map->refcount, rcar_du_vsp_fb_map_release,
+		       &map->vsp->maps_lock);
+}
+
+/*
+ * The display needs the in-fence of a plane to be signaled by the next
+ * vertical blanking to display the new framebuffer in time. Track the fence
+ * with that deadline to account for late fences once they have been waited
+ * for. The fence is only tracked on CRTCs that are already running.
+ */
+static void rcar_du_vsp_plane_track_fence(struct drm_plane_state *state)
+{
+	struct rcar_du_vsp_plane_state *rstate = to_rcar_vsp_plane_state(state);
+	struct drm_crtc_state *crtc_state;
+
+	if (!state->fence)
+		return;
+
+	crtc_state = drm_atomic_get_new_crtc_state(state->state, state->crtc);
+	if (!crtc_state || drm_atomic_crtc_needs_modeset(crtc_state))
+		return;
+
+	if (rcar_du_crtc_next_vblank(to_rcar_crtc(state->crtc),
+				     &rstate->deadline) < 0)
+		return;
+
+	rstate->fence = dma_fence_get(state->fence);
+}
+
+void rcar_du_vsp_account_fences(struct drm_atomic_state *state)
+{
+	struct drm_plane_state *new_state;
+	struct drm_plane *plane;
+	unsigned int i;
+
+	for_each_new_plane_in_state(state, plane, new_state, i) {
+		struct rcar_du_vsp_plane_state *rstate =
+			to_rcar_vsp_plane_state(new_state);
+		struct dma_fence *fence = rstate->fence;
+		struct rcar_du_crtc *rcrtc;
+		bool late;
+
+		if (!fence)
+			continue;
+
+		late = test_bit(DMA_FENCE_FLAG_TIMESTAMP_BIT, &fence->flags) &&
+		       ktime_after(fence->timestamp, rstate->deadline);
+
+		rcrtc = to_rcar_crtc(new_state->crtc);
+
+		spin_lock_irq(&rcrtc->vblank_lock);
+		rcrtc->fence_stats.fences++;
+		if (late)
+			rcrtc->fence_stats.late++;
+		spin_unlock_irq(&rcrtc->vblank_lock);
+
+		dma_fence_put(fence);
+		rstate->fence = NULL;
+	}
+}
+
 static int rcar_du_vsp_plane_prepare_fb(struct drm_plane *plane,
 					struct drm_plane_state *state)
 {
 	struct rcar_du_vsp_plane_state *rstate = to_rcar_vsp_plane_state(state);
 	struct rcar_du_vsp *vsp = to_rcar_vsp_plane(plane)->vsp;
+	struct rcar_du_vsp_fb_map *map;
+	unsigned int i;
 	int ret;
 
 	/*
@@ -269,11 +529,33 @@ static int rcar_du_vsp_plane_prepare_fb(struct drm_plane *plane,
 	if (!state->visible)
 		return 0;
 
-	ret = rcar_du_vsp_map_fb(vsp, state->fb, rstate->sg_tables);
+	ret = drm_gem_fb_prepare_fb(plane, state);
 	if (ret < 0)
 		return ret;
 
-	return drm_gem_fb_prepare_fb(plane, state);
+	rcar_du_vsp_plane_track_fence(state);
+
+	/*
+	 * Clean the CPU caches for buffers mapped cached, the CPU may have
+	 * written to them since they were last displayed.
+	 */
+	for (i = 0; i < state->fb->format->num_planes; ++i)
+		rcar_du_gem_sync_for_device(state->fb->obj[i]);
+
+	/*
+	 * If the framebuffer is already mapped to the VSP, share the mapping
+	 * instead of mapping the framebuffer again. This avoids the IOMMU
+	 * mapping cost and, when the plane keeps displaying the same
+	 * framebuffer, keeps the DMA addresses stable, allowing
+	 * .atomic_update() to skip reprogramming the plane.
+	 */
+	map = rcar_du_vsp_fb_map_get(vsp, state->fb);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
+
+	rstate->map = map;
+
+	return 0;
 }
 
 void rcar_du_vsp_unmap_fb(struct rcar_du_vsp *vsp, struct drm_framebuffer *fb,
@@ -293,12 +575,12 @@ static void rcar_du_vsp_plane_cleanup_fb(struct drm_plane *plane,
 					 struct drm_plane_state *state)
 {
 	struct rcar_du_vsp_plane_state *rstate = to_rcar_vsp_plane_state(state);
-	struct rcar_du_vsp *vsp = to_rcar_vsp_plane(plane)->vsp;
 
-	if (!state->visible)
+	if (!state->visible || !rstate->map)
 		return;
 
-	rcar_du_vsp_unmap_fb(vsp, state->fb, rstate->sg_tables);
+	rcar_du_vsp_fb_map_put(rstate->map);
+	rstate->map = NULL;
 }
 
 static int rcar_du_vsp_plane_atomic_check(struct drm_plane *plane,
@@ -306,20 +588,468 @@ static int rcar_du_vsp_plane_atomic_check(struct drm_plane *plane,
 {
 	struct rcar_du_vsp_plane_state *rstate = to_rcar_vsp_plane_state(state);
 
+	if (drm_rect_width(&state->src) >> 16 > RCAR_DU_VSP_MAX_SIZE ||
+	    drm_rect_height(&state->src) >> 16 > RCAR_DU_VSP_MAX_SIZE) {
+		dev_dbg(plane->dev->dev, "%s: source rectangle too large\n",
+			__func__);
+		return -EINVAL;
+	}
+
+	/*
+	 * The RPF implements reflections only, 180° rotation is performed by
+	 * reflecting in both directions.
+	 */
+	if (drm_rotation_simplify(state->rotation, RCAR_DU_VSP_ROTATIONS) &
+	    ~RCAR_DU_VSP_ROTATIONS) {
+		dev_dbg(plane->dev->dev, "%s: unsupported rotation 0x%x\n",
+			__func__, state->rotation);
+		return -EINVAL;
+	}
+
+	/*
+	 * The "None" blend mode requires an opaque variant of the format, which
+	 * doesn't exist for all formats with alpha (RGBA1010102 for instance).
+	 */
+	if (state->fb && state->fb->format->has_alpha &&
+	    state->pixel_blend_mode == DRM_MODE_BLEND_PIXEL_NONE &&
+	    rcar_du_vsp_opaque_format(state->fb->format->format) ==
+	    state->fb->format->format) {
+		dev_dbg(plane->dev->dev,
+			"%s: no opaque variant of format %08x\n", __func__,
+			state->fb->format->format);
+		return -EINVAL;
+	}
+
+	/*
+	 * Scaling isn't supported. VSP planes are only used on Gen3, where the
+	 * VSP2-D instances that feed the DU have no UDS in their display
+	 * pipeline, and __rcar_du_plane_atomic_check() thus rejects scaled
+	 * planes.
+	 */
 	return __rcar_du_plane_atomic_check(plane, state, &rstate->format);
 }
 
+/*
+ * When a plane keeps displaying the same framebuffer through the same mapping
+ * with an unchanged configuration, the VSP can keep processing it with its
+ * current configuration. The VSP fetches the whole visible area of every plane
+ * for every frame, damage clips are thus not supported, as there is no partial
+ * fetch to program.
+ */
+static bool rcar_du_vsp_plane_unchanged(struct drm_plane_state *old_state,
+					struct drm_plane_state *state)
+{
+	struct rcar_du_vsp_plane_state *old_rstate =
+		to_rcar_vsp_plane_state(old_state);
+	struct rcar_du_vsp_plane_state *rstate = to_rcar_vsp_plane_state(state);
+
+	if (!old_state->visible || old_state->crtc != state->crtc)
+		return false;
+
+	/* The VSP pipeline is reconfigured from scratch on mode set. */
+	if (drm_atomic_crtc_needs_modeset(state->crtc->state))
+		return false;
+
+	if (!old_rstate->map || old_rstate->map != rstate->map)
+		return false;
+
+	if (old_rstate->format != rstate->format ||
+	    !drm_rect_equals(&old_state->src, &state->src) ||
+	    !drm_rect_equals(&old_state->dst, &state->dst) ||
+	    old_state->zpos != state->zpos ||
+	    old_state->rotation != state->rotation ||
+	    old_state->pixel_blend_mode != state->pixel_blend_mode)
+		return false;
+
+	return old_rstate->alpha == rstate->alpha &&
+	       old_rstate->colorkey == rstate->colorkey &&
+	       old_rstate->colorkey_alpha == rstate->colorkey_alpha;
+}
+
 static void rcar_du_vsp_plane_atomic_update(struct drm_plane *plane,
 					struct drm_plane_state *old_state)
 {
 	struct rcar_du_vsp_plane *rplane = to_rcar_vsp_plane(plane);
 	struct rcar_du_crtc *crtc = to_rcar_crtc(old_state->crtc);
 
-	if (plane->state->visible)
-		rcar_du_vsp_plane_setup(rplane);
-	else if (old_state->crtc)
+	/* Remove the plane from its previous pipe when it moves to another. */
+	if (old_state->visible && old_state->crtc != plane->state->crtc &&
+	    plane->state->visible)
 		vsp1_du_atomic_update(rplane->vsp->vsp, crtc->vsp_pipe,
 				      rplane->index, NULL);
+
+	if (plane->state->visible) {
+		if (!rcar_du_vsp_plane_unchanged(old_state, plane->state))
+			rcar_du_vsp_plane_setup(rplane);
+	} else if (old_state->crtc)
+		vsp1_du_atomic_update(rplane->vsp->vsp, crtc->vsp_pipe,
+				      rplane->index, NULL);
+}
+
+/* -----------------------------------------------------------------------------
+ * Mailbox Page Flips
+ *
+ * Asynchronous page flips replace the framebuffer of the primary plane in its
+ * current state and commit a new display list right away, without going
+ * through an atomic commit. The VSP never replaces the display list queued to
+ * the hardware, a display list committed behind it is kept pending, and only
+ * the pending display list is replaced. To display every flip, at most two
+ * display lists can thus be waiting, further flips fall back to regular page
+ * flips.
+ *
+ * The VSP reports a frame completion each time a new display list starts being
+ * displayed. The display lists flushed and not displayed yet are counted, and
+ * each flip counts the frame completions until its own display list is
+ * displayed. Its event is then sent, and the framebuffer it replaced, which
+ * the VSP has stopped reading, is released.
+ *
+ * The event of a regular commit is sent at the first frame completion
+ * following its flush, commits thus wait for all the display lists flushed by
+ * mailbox flips to be displayed before flushing their own.
+ */
+
+/**
+ * struct rcar_du_vsp_mailbox_flip - Mailbox page flip
+ * @list: entry in the CRTC mailbox flips list
+ * @event: event to post when the flip is displayed
+ * @fb: the framebuffer replaced by the flip
+ * @map: VSP mapping of @fb
+ * @frames: number of frame completions before the flip is displayed
+ */
+struct rcar_du_vsp_mailbox_flip {
+	struct list_head list;
+	struct drm_pending_vblank_event *event;
+	struct drm_framebuffer *fb;
+	struct rcar_du_vsp_fb_map *map;
+	unsigned int frames;
+};
+
+static void rcar_du_vsp_mailbox_release(struct work_struct *work)
+{
+	struct rcar_du_crtc *crtc =
+		container_of(work, struct rcar_du_crtc, mailbox.release_work);
+	struct drm_device *dev = crtc->crtc.dev;
+	struct rcar_du_vsp_mailbox_flip *flip;
+	struct rcar_du_vsp_mailbox_flip *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	list_for_each_entry_safe(flip, next, &crtc->mailbox.flips, list) {
+		if (!flip->frames)
+			list_move_tail(&flip->list, &list);
+	}
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	list_for_each_entry_safe(flip, next, &list, list) {
+		rcar_du_vsp_fb_map_put(flip->map);
+		drm_framebuffer_put(flip->fb);
+		kfree(flip);
+	}
+}
+
+static void rcar_du_vsp_mailbox_complete(struct rcar_du_crtc *crtc,
+					 bool stopped)
+{
+	struct drm_device *dev = crtc->crtc.dev;
+	struct rcar_du_vsp_mailbox_flip *flip;
+	unsigned int events = 0;
+	bool release = false;
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+
+	if (stopped)
+		crtc->mailbox.queued = 0;
+	else if (crtc->mailbox.queued)
+		crtc->mailbox.queued--;
+
+	idle = !crtc->mailbox.queued;
+
+	list_for_each_entry(flip, &crtc->mailbox.flips, list) {
+		if (!flip->frames)
+			continue;
+
+		flip->frames = stopped ? 0 : flip->frames - 1;
+		if (flip->frames)
+			continue;
+
+		if (flip->event) {
+			drm_crtc_send_vblank_event(&crtc->crtc, flip->event);
+			flip->event = NULL;
+			events++;
+		}
+
+		release = true;
+	}
+
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	while (events--)
+		drm_crtc_vblank_put(&crtc->crtc);
+
+	if (idle)
+		wake_up(&crtc->flip_wait);
+
+	if (release)
+		schedule_work(&crtc->mailbox.release_work);
+}
+
+/*
+ * Return true if display lists flushed to the VSP haven't started being
+ * displayed yet.
+ */
+bool rcar_du_vsp_dl_pending(struct rcar_du_crtc *crtc)
+{
+	struct drm_device *dev = crtc->crtc.dev;
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	pending = crtc->mailbox.queued != 0;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	return pending;
+}
+
+void rcar_du_vsp_mailbox_wait(struct rcar_du_crtc *crtc)
+{
+	if (wait_event_timeout(crtc->flip_wait,
+			       !rcar_du_vsp_dl_pending(crtc),
+			       msecs_to_jiffies(100)))
+		return;
+
+	dev_warn(crtc->dev->dev, "mailbox flip timeout\n");
+}
+
+void rcar_du_vsp_mailbox_init(struct rcar_du_crtc *crtc)
+{
+	INIT_LIST_HEAD(&crtc->mailbox.flips);
+	INIT_WORK(&crtc->mailbox.release_work, rcar_du_vsp_mailbox_release);
+}
+
+int rcar_du_vsp_page_flip(struct rcar_du_crtc *crtc, struct drm_framebuffer *fb,
+			  struct drm_pending_vblank_event *event)
+{
+	struct drm_device *dev = crtc->crtc.dev;
+	struct drm_plane *plane = crtc->crtc.primary;
+	struct drm_plane_state *state = plane->state;
+	struct rcar_du_vsp_plane_state *rstate = to_rcar_vsp_plane_state(state);
+	struct rcar_du_vsp *vsp = to_rcar_vsp_plane(plane)->vsp;
+	struct drm_connector_state *wb_state = crtc->writeback.base.state;
+	struct rcar_du_vsp_mailbox_flip *flip;
+	struct drm_crtc_commit *commit;
+	struct rcar_du_vsp_fb_map *map;
+	unsigned int queued;
+	unsigned long flags;
+	unsigned int i;
+	int ret;
+
+	/*
+	 * Only flips replacing the framebuffer of the visible primary plane
+	 * with a framebuffer of identical size and format, whose implicit
+	 * fences have all been signaled, are handled here. Regular commits
+	 * still in flight and writeback jobs require a regular flip.
+	 */
+	if (!crtc->crtc.state->active || !state->visible ||
+	    state->crtc != &crtc->crtc || !rstate->map)
+		return -EAGAIN;
+
+	if (fb->format != state->fb->format || fb->width != state->fb->width ||
+	    fb->height != state->fb->height)
+		return -EAGAIN;
+
+	/*
+	 * Any commit on the CRTC, even one that doesn't touch the primary plane,
+	 * reprograms the VSP pipe from its commit tail without holding locks.
+	 * Wait for it to be fully applied.
+	 */
+	commit = crtc->crtc.state->commit;
+	if (commit && (!try_wait_for_completion(&commit->hw_done) ||
+		       !try_wait_for_completion(&commit->flip_done)))
+		return -EAGAIN;
+
+	if (wb_state && wb_state->crtc)
+		return -EAGAIN;
+
+	for (i = 0; i < fb->format->num_planes; ++i) {
+		if (!dma_resv_test_signaled_rcu(fb->obj[i]->resv, false))
+			return -EAGAIN;
+	}
+
+	/*
+	 * With two display lists already waiting, the pending one would be
+	 * replaced by this flip and never displayed.
+	 */
+	spin_lock_irqsave(&dev->event_lock, flags);
+	queued = crtc->mailbox.queued;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	if (queued >= 2)
+		return -EAGAIN;
+
+	flip = kzalloc(sizeof(*flip), GFP_KERNEL);
+	if (!flip)
+		return -ENOMEM;
+
+	map = rcar_du_vsp_fb_map_get(vsp, fb);
+	if (IS_ERR(map)) {
+		kfree(flip);
+		return PTR_ERR(map);
+	}
+
+	if (event) {
+		ret = drm_crtc_vblank_get(&crtc->crtc);
+		if (ret < 0) {
+			rcar_du_vsp_fb_map_put(map);
+			kfree(flip);
+			return ret;
+		}
+	}
+
+	for (i = 0; i < fb->format->num_planes; ++i)
+		rcar_du_gem_sync_for_device(fb->obj[i]);
+
+	/* Swap the framebuffer in the current state of the primary plane. */
+	flip->event = event;
+	flip->fb = state->fb;
+	flip->map = rstate->map;
+
+	drm_framebuffer_get(fb);
+	state->fb = fb;
+	rstate->map = map;
+
+	/*
+	 * Count the frame completions from the flush of the display list, the
+	 * completions reported until then decrement both the number of queued
+	 * display lists and the number of frames of the flip.
+	 */
+	spin_lock_irqsave(&dev->event_lock, flags);
+	flip->frames = crtc->mailbox.queued + 1;
+	list_add_tail(&flip->list, &crtc->mailbox.flips);
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	rcar_du_vsp_atomic_begin(crtc);
+	rcar_du_vsp_plane_setup(to_rcar_vsp_plane(plane));
+	rcar_du_vsp_atomic_flush(crtc);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Atomic Check
+ */
+
+/*
+ * The VSPDL overlay planes can be routed to the BRU or BRS pipe at runtime.
+ * The BRU blends up to all the RPFs, but the BRS only has brs_num inputs. The
+ * planes routed to the BRS are tracked in a private object, which is only
+ * added to the commits that change the routing of a plane. This avoids
+ * pulling the planes and CRTCs of the other pipe in the commits.
+ */
+
+/**
+ * struct rcar_du_vsp_routing_state - VSPDL overlay planes routing state
+ * @state: base DRM private state
+ * @brs_planes: bitmask of the indices of the visible planes routed to the BRS
+ */
+struct rcar_du_vsp_routing_state {
+	struct drm_private_state state;
+	u32 brs_planes;
+};
+
+static inline struct rcar_du_vsp_routing_state *
+to_rcar_vsp_routing_state(struct drm_private_state *state)
+{
+	return container_of(state, struct rcar_du_vsp_routing_state, state);
+}
+
+static struct drm_private_state *
+rcar_du_vsp_routing_duplicate_state(struct drm_private_obj *obj)
+{
+	struct rcar_du_vsp_routing_state *copy;
+
+	copy = kmemdup(to_rcar_vsp_routing_state(obj->state), sizeof(*copy),
+		       GFP_KERNEL);
+	if (!copy)
+		return NULL;
+
+	__drm_atomic_helper_private_obj_duplicate_state(obj, &copy->state);
+
+	return &copy->state;
+}
+
+static void rcar_du_vsp_routing_destroy_state(struct drm_private_obj *obj,
+					      struct drm_private_state *state)
+{
+	kfree(to_rcar_vsp_routing_state(state));
+}
+
+static const struct drm_private_state_funcs rcar_du_vsp_routing_funcs = {
+	.atomic_duplicate_state = rcar_du_vsp_routing_duplicate_state,
+	.atomic_destroy_state = rcar_du_vsp_routing_destroy_state,
+};
+
+static bool rcar_du_vsp_plane_on_brs(struct drm_plane_state *state)
+{
+	return state->visible && to_rcar_crtc(state->crtc)->vsp_pipe == 1;
+}
+
+static int rcar_du_vsp_check_routing(struct rcar_du_device *rcdu,
+				     struct drm_atomic_state *state)
+{
+	struct rcar_du_vsp *vsp = &rcdu->vsps[VSPDL_CH];
+	struct rcar_du_vsp_routing_state *routing = NULL;
+	struct drm_plane_state *old_state;
+	struct drm_plane_state *new_state;
+	struct drm_plane *plane;
+	unsigned int i;
+
+	if (!rcdu->vspdl_fix || rcdu->brs_num < 2)
+		return 0;
+
+	for_each_oldnew_plane_in_state(state, plane, old_state, new_state, i) {
+		struct rcar_du_vsp_plane *rplane = to_rcar_vsp_plane(plane);
+		bool brs = rcar_du_vsp_plane_on_brs(new_state);
+
+		if (rplane->vsp != vsp ||
+		    rcar_du_vsp_plane_on_brs(old_state) == brs)
+			continue;
+
+		if (!routing) {
+			struct drm_private_state *priv;
+
+			priv = drm_atomic_get_private_obj_state(state,
+								&vsp->routing);
+			if (IS_ERR(priv))
+				return PTR_ERR(priv);
+
+			routing = to_rcar_vsp_routing_state(priv);
+		}
+
+		if (brs)
+			routing->brs_planes |= BIT(rplane->index);
+		else
+			routing->brs_planes &= ~BIT(rplane->index);
+	}
+
+	if (routing && hweight32(routing->brs_planes) > rcdu->brs_num) {
+		dev_dbg(rcdu->dev, "%s: %u planes routed to BRS, max %u\n",
+			__func__, hweight32(routing->brs_planes),
+			rcdu->brs_num);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int rcar_du_vsp_atomic_check(struct drm_device *dev,
+			     struct drm_atomic_state *state)
+{
+	struct rcar_du_device *rcdu = dev->dev_private;
+
+	return rcar_du_vsp_check_routing(rcdu, state);
 }
 
 static const struct drm_plane_helper_funcs rcar_du_vsp_plane_helper_funcs = {
@@ -337,7 +1067,7 @@ rcar_du_vsp_plane_atomic_duplicate_state(struct drm_plane *plane)
 	if (WARN_ON(!plane->state))
 		return NULL;
 
-	copy = kzalloc(sizeof(*copy), GFP_KERNEL);
+	copy = kmem_cache_zalloc(rcar_du_vsp_plane_state_cache, GFP_KERNEL);
 	if (copy == NULL)
 		return NULL;
 
@@ -352,8 +1082,10 @@ rcar_du_vsp_plane_atomic_duplicate_state(struct drm_plane *plane)
 static void rcar_du_vsp_plane_atomic_destroy_state(struct drm_plane *plane,
 						   struct drm_plane_state *state)
 {
+	dma_fence_put(to_rcar_vsp_plane_state(state)->fence);
 	__drm_atomic_helper_plane_destroy_state(state);
-	kfree(to_rcar_vsp_plane_state(state));
+	kmem_cache_free(rcar_du_vsp_plane_state_cache,
+			to_rcar_vsp_plane_state(state));
 }
 
 static void rcar_du_vsp_plane_reset(struct drm_plane *plane)
@@ -365,7 +1097,7 @@ static void rcar_du_vsp_plane_reset(struct drm_plane *plane)
 		plane->state = NULL;
 	}
 
-	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	state = kmem_cache_zalloc(rcar_du_vsp_plane_state_cache, GFP_KERNEL);
 	if (state == NULL)
 		return;
 
@@ -391,8 +1123,12 @@ int rcar_du_vsp_write_back(struct drm_device *dev, void *data,
 	struct rcar_du_device *rcdu;
 	const struct drm_display_mode *mode;
 	u32 pixelformat, bpp;
+	unsigned int min_pitch;
 	unsigned int pitch;
+	struct v4l2_rect crop;
 	dma_addr_t mem[3];
+	u32 displays;
+	bool full;
 
 	obj = drm_mode_object_find(dev, file_priv, sh->crtc_id,
 				   DRM_MODE_OBJECT_CRTC);
@@ -422,21 +1158,58 @@ int rcar_du_vsp_write_back(struct drm_device *dev, void *data,
 		return -EINVAL;
 	}
 
-	pitch = mode->hdisplay * bpp / 8;
-
 	mem[0] = sh->buff;
 	mem[1] = 0;
 	mem[2] = 0;
 
-	if (sh->width != mode->hdisplay ||
-	    sh->height != mode->vdisplay)
+	/*
+	 * The capture region is a (x, y, width, height) rectangle inside the
+	 * frame, the full frame when x and y are 0 and the size matches the
+	 * mode. A pitch of 0 selects the minimum pitch for the region width.
+	 */
+	if (!sh->width || !sh->height ||
+	    sh->width > mode->hdisplay || sh->x > mode->hdisplay - sh->width ||
+	    sh->height > mode->vdisplay || sh->y > mode->vdisplay - sh->height)
+		return -EINVAL;
+
+	min_pitch = sh->width * bpp / 8;
+	pitch = sh->pitch ? sh->pitch : min_pitch;
+	if (pitch < min_pitch)
 		return -EINVAL;
 
-	if ((pitch * mode->vdisplay) > sh->buff_len)
+	if ((u64)pitch * sh->height > sh->buff_len)
 		return -EINVAL;
 
-	ret = vsp1_du_setup_wb(rcrtc->vsp->vsp, pixelformat, pitch, mem,
-			       rcrtc->vsp_pipe);
+	/*
+	 * Regions smaller than the frame are cropped by the WPF, only the
+	 * region is written to memory. The WPF also feeds the DU, cropping
+	 * would crop the display output as well. It is thus only allowed on
+	 * CRTCs that don't drive any display output.
+	 */
+	full = sh->width == mode->hdisplay && sh->height == mode->vdisplay;
+
+	displays = crtc->state->connector_mask;
+	if (rcrtc->writeback.base.dev)
+		displays &= ~drm_connector_mask(&rcrtc->writeback.base);
+
+	if (!full && displays) {
+		dev_dbg(rcdu->dev, "%s: region capture requires no display\n",
+			__func__);
+		return -EINVAL;
+	}
+
+	crop.left = sh->x;
+	crop.top = sh->y;
+	crop.width = sh->width;
+	crop.height = sh->height;
+
+	if (full)
+		ret = vsp1_du_setup_wb(rcrtc->vsp->vsp, pixelformat, pitch,
+				       mem, rcrtc->vsp_pipe);
+	else
+		ret = vsp1_du_setup_wb_crop(rcrtc->vsp->vsp, pixelformat,
+					    pitch, mem, &crop,
+					    rcrtc->vsp_pipe);
 	if (ret != 0)
 		return ret;
 
@@ -548,6 +1321,9 @@ static void rcar_du_vsp_cleanup(struct drm_device *dev, void *res)
 {
 	struct rcar_du_vsp *vsp = res;
 
+	if (vsp->routing.funcs)
+		drm_atomic_private_obj_fini(&vsp->routing);
+
 	put_device(vsp->vsp);
 }
 
@@ -555,7 +1331,9 @@ int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 		     unsigned int crtcs)
 {
 	struct rcar_du_device *rcdu = vsp->dev;
+	struct platform_device *fcp_pdev;
 	struct platform_device *pdev;
+	struct device_node *fcp_np;
 	unsigned int num_crtcs = hweight32(crtcs);
 	unsigned int i;
 	int ret;
@@ -567,6 +1345,24 @@ int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 
 	vsp->vsp = &pdev->dev;
 
+	INIT_LIST_HEAD(&vsp->maps);
+	mutex_init(&vsp->maps_lock);
+
+	/*
+	 * On Gen3 the VSP accesses memory through its FCP, check whether the
+	 * FCP is behind an IOMMU to allow scanning out non-contiguous memory.
+	 */
+	fcp_np = of_parse_phandle(np, "renesas,fcp", 0);
+	if (fcp_np) {
+		fcp_pdev = of_find_device_by_node(fcp_np);
+		of_node_put(fcp_np);
+
+		if (fcp_pdev) {
+			vsp->iommu = device_iommu_mapped(&fcp_pdev->dev);
+			put_device(&fcp_pdev->dev);
+		}
+	}
+
 	ret = drmm_add_action(rcdu->ddev, rcar_du_vsp_cleanup, vsp);
 	if (ret < 0)
 		return ret;
@@ -578,6 +1374,12 @@ int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 	 /*
 	  * The VSP2D (Gen3) has 5 RPFs, but the VSP1D (Gen2) is limited to
 	  * 4 RPFs.
+	  *
+	  * Exposing more planes would require pre-composing layers in another
+	  * VSP instance. The VSPs usable for that purpose (VSPB, VSPI) are only
+	  * accessible through the V4L2 mem-to-mem API, and the VSPDs can only
+	  * write back to memory in sync with the display timings of their DU
+	  * channel, so planes are limited to the RPFs of the display VSP.
 	  */
 	vsp->num_planes = rcdu->info->gen >= 3 ? 5 : 4;
 
@@ -602,23 +1404,22 @@ int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 
 			pair_ch = rcdu->info->routes[pair_con].possible_crtcs;
 
+			/*
+			 * Overlay planes can be routed to either pipe when the
+			 * BRS has more than one input, the BRS occupancy is
+			 * then checked in rcar_du_vsp_atomic_check().
+			 */
 			if (rcdu->brs_num == 0) {
 				crtcs = BIT(0);
 				if (i > 0)
 					type = DRM_PLANE_TYPE_OVERLAY;
+			} else if (type == DRM_PLANE_TYPE_PRIMARY) {
+				i == 1 ? (crtcs = pair_ch) :
+					 (crtcs = BIT(0));
 			} else if (rcdu->brs_num == 1) {
-				if (type == DRM_PLANE_TYPE_PRIMARY)
-					i == 1 ? (crtcs = pair_ch) :
-						 (crtcs = BIT(0));
-				else
-					crtcs = BIT(0);
+				crtcs = BIT(0);
 			} else {
-				if (type == DRM_PLANE_TYPE_PRIMARY)
-					i == 1 ? (crtcs = pair_ch) :
-						 (crtcs = BIT(0));
-				else
-					i == 4 ? (crtcs = pair_ch) :
-						 (crtcs = BIT(0));
+				crtcs = BIT(0) | pair_ch;
 			}
 		}
 
@@ -633,6 +1434,15 @@ int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 		drm_plane_helper_add(&plane->plane,
 				     &rcar_du_vsp_plane_helper_funcs);
 
+		/* Only the Gen3 RPFs can reflect their input. */
+		if (rcdu->info->gen >= 3)
+			drm_plane_create_rotation_property(&plane->plane,
+							   DRM_MODE_ROTATE_0,
+							   DRM_MODE_ROTATE_0 |
+							   DRM_MODE_ROTATE_180 |
+							   DRM_MODE_REFLECT_X |
+							   DRM_MODE_REFLECT_Y);
+
 		if (type == DRM_PLANE_TYPE_PRIMARY) {
 			drm_plane_create_zpos_immutable_property(&plane->plane,
 								 0);
@@ -648,8 +1458,24 @@ int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 							   0);
 			drm_plane_create_zpos_property(&plane->plane, 1, 1,
 						       vsp->num_planes - 1);
+			drm_plane_create_blend_mode_property(&plane->plane,
+					BIT(DRM_MODE_BLEND_PIXEL_NONE) |
+					BIT(DRM_MODE_BLEND_PREMULTI) |
+					BIT(DRM_MODE_BLEND_COVERAGE));
 		}
 	}
 
+	if (rcdu->vspdl_fix && vsp->index == VSPDL_CH && rcdu->brs_num >= 2) {
+		struct rcar_du_vsp_routing_state *routing;
+
+		routing = kzalloc(sizeof(*routing), GFP_KERNEL);
+		if (!routing)
+			return -ENOMEM;
+
+		drm_atomic_private_obj_init(rcdu->ddev, &vsp->routing,
+					    &routing->state,
+					    &rcar_du_vsp_routing_funcs);
+	}
+
 	return 0;
 }
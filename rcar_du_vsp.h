@@ -10,11 +10,28 @@
 #ifndef __RCAR_DU_VSP_H__
 #define __RCAR_DU_VSP_H__
 
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#include <drm/drm_atomic.h>
 #include <drm/drm_plane.h>
 
 #define VSPDL_CH	0	/* VSPDL channel in r8a7795 and r8a77965 */
 
+/* Maximum frame size processed by the VSP, in pixels. */
+#define RCAR_DU_VSP_MAX_SIZE	8190
+
+/* Rotations supported by the RPF, after drm_rotation_simplify(). */
+#define RCAR_DU_VSP_ROTATIONS	(DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X | \
+				 DRM_MODE_REFLECT_Y)
+
+struct dma_fence;
+struct drm_atomic_state;
+struct drm_device;
 struct drm_framebuffer;
+struct drm_pending_vblank_event;
 struct rcar_du_format_info;
 struct rcar_du_vsp;
 struct sg_table;
@@ -25,12 +42,31 @@ struct rcar_du_vsp_plane {
 	unsigned int index;
 };
 
+/**
+ * struct rcar_du_vsp - VSP compositor
+ * @index: VSP index
+ * @vsp: the VSP device
+ * @dev: the DU device
+ * @planes: KMS planes backed by the VSP RPFs
+ * @num_planes: number of planes
+ * @iommu: true if the VSP accesses memory through an IOMMU
+ * @maps: framebuffers mapped to the VSP
+ * @maps_lock: protects the @maps list
+ * @routing: routing of the overlay planes to the BRU or BRS pipe, only
+ * initialized for the VSPDL when the BRS has more than one input
+ */
 struct rcar_du_vsp {
 	unsigned int index;
 	struct device *vsp;
 	struct rcar_du_device *dev;
 	struct rcar_du_vsp_plane *planes;
 	unsigned int num_planes;
+	bool iommu;
+
+	struct list_head maps;
+	struct mutex maps_lock;
+
+	struct drm_private_obj routing;
 };
 
 static inline struct rcar_du_vsp_plane *to_rcar_vsp_plane(struct drm_plane *p)
@@ -38,25 +74,49 @@ static inline struct rcar_du_vsp_plane *to_rcar_vsp_plane(struct drm_plane *p)
 	return container_of(p, struct rcar_du_vsp_plane, plane);
 }
 
+/**
+ * struct rcar_du_vsp_fb_map - Mapping of a framebuffer to the VSP
+ * @refcount: reference count, the mapping is shared by all the plane states
+ * of the VSP that display the framebuffer
+ * @list: entry in the VSP maps list
+ * @vsp: VSP the framebuffer is mapped to
+ * @fb: the mapped framebuffer
+ * @sg_tables: scatter-gather tables for the frame buffer memory
+ */
+struct rcar_du_vsp_fb_map {
+	struct kref refcount;
+	struct list_head list;
+	struct rcar_du_vsp *vsp;
+	struct drm_framebuffer *fb;
+	struct sg_table sg_tables[3];
+};
+
 /**
  * struct rcar_du_vsp_plane_state - Driver-specific plane state
  * @state: base DRM plane state
  * @format: information about the pixel format used by the plane
- * @sg_tables: scatter-gather tables for the frame buffer memory
+ * @map: VSP mapping of the frame buffer, only set for visible planes between
+ * .prepare_fb() and .cleanup_fb()
  * @alpha: value of the plane alpha property
  * @colorkey: value of the color for which to apply colorkey_alpha, bit 24
  * tells if it is enabled or not
  * @colorkey_alpha: alpha to be used for pixels with color equal to colorkey
+ * @fence: in-fence tracked for deadline accounting, between .prepare_fb() and
+ * the commit tail
+ * @deadline: time at which the display needs @fence to be signaled
  */
 struct rcar_du_vsp_plane_state {
 	struct drm_plane_state state;
 
 	const struct rcar_du_format_info *format;
-	struct sg_table sg_tables[3];
+	struct rcar_du_vsp_fb_map *map;
 
 	unsigned int alpha;
 	u32 colorkey;
 	u32 colorkey_alpha;
+
+	struct dma_fence *fence;
+	ktime_t deadline;
 };
 
 static inline struct rcar_du_vsp_plane_state *
@@ -68,10 +128,18 @@ to_rcar_vsp_plane_state(struct drm_plane_state *state)
 #ifdef CONFIG_DRM_RCAR_VSP
 int rcar_du_vsp_init(struct rcar_du_vsp *vsp, struct device_node *np,
 		     unsigned int crtcs);
+int rcar_du_vsp_atomic_check(struct drm_device *dev,
+			     struct drm_atomic_state *state);
+void rcar_du_vsp_account_fences(struct drm_atomic_state *state);
 void rcar_du_vsp_enable(struct rcar_du_crtc *crtc);
 void rcar_du_vsp_disable(struct rcar_du_crtc *crtc);
 void rcar_du_vsp_atomic_begin(struct rcar_du_crtc *crtc);
 void rcar_du_vsp_atomic_flush(struct rcar_du_crtc *crtc);
+void rcar_du_vsp_mailbox_init(struct rcar_du_crtc *crtc);
+void rcar_du_vsp_mailbox_wait(struct rcar_du_crtc *crtc);
+bool rcar_du_vsp_dl_pending(struct rcar_du_crtc *crtc);
+int rcar_du_vsp_page_flip(struct rcar_du_crtc *crtc, struct drm_framebuffer *fb,
+			  struct drm_pending_vblank_event *event);
 int rcar_du_set_vmute(struct drm_device *dev, void *data,
 		      struct drm_file *file_priv);
 int rcar_du_vsp_write_back(struct drm_device *dev, void *data,
@@ -80,6 +148,9 @@ int rcar_du_vsp_map_fb(struct rcar_du_vsp *vsp, struct drm_framebuffer *fb,
 		       struct sg_table sg_tables[3]);
 void rcar_du_vsp_unmap_fb(struct rcar_du_vsp *vsp, struct drm_framebuffer *fb,
 			  struct sg_table sg_tables[3]);
+struct rcar_du_vsp_fb_map *
+rcar_du_vsp_fb_map_get(struct rcar_du_vsp *vsp, struct drm_framebuffer *fb);
+void rcar_du_vsp_fb_map_put(struct rcar_du_vsp_fb_map *map);
 #else
 static inline int rcar_du_vsp_init(struct rcar_du_vsp *vsp,
 				   struct device_node *np,
@@ -87,10 +158,30 @@ static inline int rcar_du_vsp_init(struct rcar_du_vsp *vsp,
 {
 	return -ENXIO;
 }
+static inline int rcar_du_vsp_atomic_check(struct drm_device *dev,
+					   struct drm_atomic_state *state)
+{
+	return 0;
+}
+static inline void rcar_du_vsp_account_fences(struct drm_atomic_state *state)
+{
+}
 static inline void rcar_du_vsp_enable(struct rcar_du_crtc *crtc) { };
 static inline void rcar_du_vsp_disable(struct rcar_du_crtc *crtc) { };
 static inline void rcar_du_vsp_atomic_begin(struct rcar_du_crtc *crtc) { };
 static inline void rcar_du_vsp_atomic_flush(struct rcar_du_crtc *crtc) { };
+static inline void rcar_du_vsp_mailbox_init(struct rcar_du_crtc *crtc) { };
+static inline void rcar_du_vsp_mailbox_wait(struct rcar_du_crtc *crtc) { };
+static inline bool rcar_du_vsp_dl_pending(struct rcar_du_crtc *crtc)
+{
+	return false;
+}
+static inline int rcar_du_vsp_page_flip(struct rcar_du_crtc *crtc,
+					struct drm_framebuffer *fb,
+					struct drm_pending_vblank_event *event)
+{
+	return -EAGAIN;
+}
 static inline int rcar_du_set_vmute(struct drm_device *dev, void *data,
 				    struct drm_file *file_priv) { return 0; };
 static inline int rcar_du_vsp_write_back(struct drm_device *dev, void *data,
@@ -109,6 +200,14 @@ static inline void rcar_du_vsp_unmap_fb(struct rcar_du_vsp *vsp,
 					struct sg_table sg_tables[3])
 {
 }
+static inline struct rcar_du_vsp_fb_map *
+rcar_du_vsp_fb_map_get(struct rcar_du_vsp *vsp, struct drm_framebuffer *fb)
+{
+	return ERR_PTR(-ENXIO);
+}
+static inline void rcar_du_vsp_fb_map_put(struct rcar_du_vsp_fb_map *map)
+{
+}
 #endif
 
 #endif /* __RCAR_DU_VSP_H__ */
@@ -11,61 +11,148 @@
 #include <drm/drm_probe_helper.h>
 #include <drm/drm_writeback.h>
 
+#include <linux/slab.h>
+
 #include "rcar_du_crtc.h"
 #include "rcar_du_drv.h"
 #include "rcar_du_kms.h"
+#include "rcar_du_vsp.h"
 #include "rcar_du_writeback.h"
 
 /**
- * struct rcar_du_wb_conn_state - Driver-specific writeback connector state
- * @state: base DRM connector state
- * @format: format of the writeback framebuffer
+ * struct rcar_du_wb_job - Driver-private data for writeback jobs
+ * @list: entry in the pool free jobs list
+ * @map: VSP mapping of the framebuffer
  */
-struct rcar_du_wb_conn_state {
-	struct drm_connector_state state;
-	const struct rcar_du_format_info *format;
+struct rcar_du_wb_job {
+	struct list_head list;
+	struct rcar_du_vsp_fb_map *map;
 };
 
-#define to_rcar_wb_conn_state(s) \
-	container_of(s, struct rcar_du_wb_conn_state, state)
+/*
+ * Move the framebuffer to the front of the mapping cache, adding it and
+ * evicting the least recently used framebuffer if needed. Must be called with
+ * the pool lock held.
+ */
+static void rcar_du_wb_cache_update(struct rcar_du_wb_pool *pool,
+				    struct drm_framebuffer *fb,
+				    struct rcar_du_vsp_fb_map *map)
+{
+	unsigned int i;
 
-/**
- * struct rcar_du_wb_job - Driver-private data for writeback jobs
- * @sg_tables: scatter-gather tables for the framebuffer memory
+	for (i = 0; i < RCAR_DU_WB_CACHE_SIZE; ++i) {
+		if (pool->fbs[i] == fb)
+			break;
+	}
+
+	if (i == RCAR_DU_WB_CACHE_SIZE) {
+		i = RCAR_DU_WB_CACHE_SIZE - 1;
+
+		if (pool->fbs[i]) {
+			rcar_du_vsp_fb_map_put(pool->maps[i]);
+			drm_framebuffer_put(pool->fbs[i]);
+		}
+
+		drm_framebuffer_get(fb);
+		kref_get(&map->refcount);
+		pool->fbs[i] = fb;
+		pool->maps[i] = map;
+	}
+
+	for (; i > 0; --i) {
+		swap(pool->fbs[i], pool->fbs[i - 1]);
+		swap(pool->maps[i], pool->maps[i - 1]);
+	}
+}
+
+void rcar_du_writeback_release_cache(struct rcar_du_crtc *rcrtc)
+{
+	struct rcar_du_wb_pool *pool = &rcrtc->wb_pool;
+	unsigned int i;
+
+	if (!rcrtc->writeback.base.dev)
+		return;
+
+	mutex_lock(&pool->lock);
+
+	for (i = 0; i < RCAR_DU_WB_CACHE_SIZE; ++i) {
+		if (!pool->fbs[i])
+			continue;
+
+		rcar_du_vsp_fb_map_put(pool->maps[i]);
+		drm_framebuffer_put(pool->fbs[i]);
+		pool->fbs[i] = NULL;
+		pool->maps[i] = NULL;
+	}
+
+	mutex_unlock(&pool->lock);
+}
+
+/*
+ * Return whether a writeback job has been queued to the VSP and hasn't
+ * completed yet.
  */
-struct rcar_du_wb_job {
-	struct sg_table sg_tables[3];
-};
+bool rcar_du_writeback_pending(struct rcar_du_crtc *rcrtc)
+{
+	struct drm_writeback_connector *wb_conn = &rcrtc->writeback;
+	unsigned long flags;
+	bool pending;
+
+	if (!wb_conn->base.dev)
+		return false;
+
+	spin_lock_irqsave(&wb_conn->job_lock, flags);
+	pending = !list_empty(&wb_conn->job_queue);
+	spin_unlock_irqrestore(&wb_conn->job_lock, flags);
+
+	return pending;
+}
 
 static int rcar_du_wb_conn_get_modes(struct drm_connector *connector)
 {
-	struct drm_device *dev = connector->dev;
-
-	return drm_add_modes_noedid(connector, dev->mode_config.max_width,
-				    dev->mode_config.max_height);
+	return drm_add_modes_noedid(connector, RCAR_DU_VSP_MAX_SIZE,
+				    RCAR_DU_VSP_MAX_SIZE);
 }
 
 static int rcar_du_wb_prepare_job(struct drm_writeback_connector *connector,
 				  struct drm_writeback_job *job)
 {
 	struct rcar_du_crtc *rcrtc = wb_to_rcar_crtc(connector);
+	struct rcar_du_wb_pool *pool = &rcrtc->wb_pool;
+	struct rcar_du_vsp_fb_map *map;
 	struct rcar_du_wb_job *rjob;
-	int ret;
 
 	if (!job->fb)
 		return 0;
 
-	rjob = kzalloc(sizeof(*rjob), GFP_KERNEL);
-	if (!rjob)
-		return -ENOMEM;
+	/*
+	 * Map the framebuffer to the VSP, reusing the mapping of the cache
+	 * when the framebuffer has been captured recently.
+	 */
+	map = rcar_du_vsp_fb_map_get(rcrtc->vsp, job->fb);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
 
-	/* Map the framebuffer to the VSP. */
-	ret = rcar_du_vsp_map_fb(rcrtc->vsp, job->fb, rjob->sg_tables);
-	if (ret < 0) {
-		kfree(rjob);
-		return ret;
+	mutex_lock(&pool->lock);
+
+	rjob = list_first_entry_or_null(&pool->jobs, struct rcar_du_wb_job,
+					list);
+	if (rjob)
+		list_del(&rjob->list);
+
+	rcar_du_wb_cache_update(pool, job->fb, map);
+
+	mutex_unlock(&pool->lock);
+
+	if (!rjob) {
+		rjob = kzalloc(sizeof(*rjob), GFP_KERNEL);
+		if (!rjob) {
+			rcar_du_vsp_fb_map_put(map);
+			return -ENOMEM;
+		}
 	}
 
+	rjob->map = map;
 	job->priv = rjob;
 	return 0;
 }
@@ -74,13 +161,18 @@ static void rcar_du_wb_cleanup_job(struct drm_writeback_connector *connector,
 				   struct drm_writeback_job *job)
 {
 	struct rcar_du_crtc *rcrtc = wb_to_rcar_crtc(connector);
+	struct rcar_du_wb_pool *pool = &rcrtc->wb_pool;
 	struct rcar_du_wb_job *rjob = job->priv;
 
 	if (!job->fb)
 		return;
 
-	rcar_du_vsp_unmap_fb(rcrtc->vsp, job->fb, rjob->sg_tables);
-	kfree(rjob);
+	rcar_du_vsp_fb_map_put(rjob->map);
+	rjob->map = NULL;
+
+	mutex_lock(&pool->lock);
+	list_add(&rjob->list, &pool->jobs);
+	mutex_unlock(&pool->lock);
 }
 
 static const struct drm_connector_helper_funcs rcar_du_wb_conn_helper_funcs = {
@@ -97,7 +189,7 @@ rcar_du_wb_conn_duplicate_state(struct drm_connector *connector)
 	if (WARN_ON(!connector->state))
 		return NULL;
 
-	copy = kzalloc(sizeof(*copy), GFP_KERNEL);
+	copy = kmem_cache_zalloc(rcar_du_wb_conn_state_cache, GFP_KERNEL);
 	if (!copy)
 		return NULL;
 
@@ -110,7 +202,8 @@ static void rcar_du_wb_conn_destroy_state(struct drm_connector *connector,
 					  struct drm_connector_state *state)
 {
 	__drm_atomic_helper_connector_destroy_state(state);
-	kfree(to_rcar_wb_conn_state(state));
+	kmem_cache_free(rcar_du_wb_conn_state_cache,
+			to_rcar_wb_conn_state(state));
 }
 
 static void rcar_du_wb_conn_reset(struct drm_connector *connector)
@@ -122,17 +215,31 @@ static void rcar_du_wb_conn_reset(struct drm_connector *connector)
 		connector->state = NULL;
 	}
 
-	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	state = kmem_cache_zalloc(rcar_du_wb_conn_state_cache, GFP_KERNEL);
 	if (state == NULL)
 		return;
 
 	__drm_atomic_helper_connector_reset(connector, &state->state);
 }
 
+static void rcar_du_wb_conn_destroy(struct drm_connector *connector)
+{
+	struct rcar_du_crtc *rcrtc =
+		wb_to_rcar_crtc(drm_connector_to_writeback(connector));
+	struct rcar_du_wb_job *rjob, *next;
+
+	rcar_du_writeback_release_cache(rcrtc);
+
+	list_for_each_entry_safe(rjob, next, &rcrtc->wb_pool.jobs, list)
+		kfree(rjob);
+
+	drm_connector_cleanup(connector);
+}
+
 static const struct drm_connector_funcs rcar_du_wb_conn_funcs = {
 	.reset = rcar_du_wb_conn_reset,
 	.fill_modes = drm_helper_probe_single_connector_modes,
-	.destroy = drm_connector_cleanup,
+	.destroy = rcar_du_wb_conn_destroy,
 	.atomic_duplicate_state = rcar_du_wb_conn_duplicate_state,
 	.atomic_destroy_state = rcar_du_wb_conn_destroy_state,
 };
@@ -146,6 +253,7 @@ static int rcar_du_wb_enc_atomic_check(struct drm_encoder *encoder,
 	const struct drm_display_mode *mode = &crtc_state->mode;
 	struct drm_device *dev = encoder->dev;
 	struct drm_framebuffer *fb;
+	unsigned int i;
 
 	if (!conn_state->writeback_job)
 		return 0;
@@ -154,7 +262,8 @@ static int rcar_du_wb_enc_atomic_check(struct drm_encoder *encoder,
 
 	/*
 	 * Verify that the framebuffer format is supported and that its size
-	 * matches the current mode.
+	 * matches the current mode. The display VSPs have no UDS, the
+	 * writeback output can't be scaled.
 	 */
 	if (fb->width != mode->hdisplay || fb->height != mode->vdisplay) {
 		dev_dbg(dev->dev, "%s: invalid framebuffer size %ux%u\n",
@@ -162,6 +271,18 @@ static int rcar_du_wb_enc_atomic_check(struct drm_encoder *encoder,
 		return -EINVAL;
 	}
 
+	/*
+	 * The CPU caches would need to be invalidated after the VSP writes to
+	 * the framebuffer, only write-combined buffers are supported.
+	 */
+	for (i = 0; i < fb->format->num_planes; ++i) {
+		if (rcar_du_gem_is_cached(fb->obj[i])) {
+			dev_dbg(dev->dev, "%s: cached framebuffer unsupported\n",
+				__func__);
+			return -EINVAL;
+		}
+	}
+
 	wb_state->format = rcar_du_format_info(fb->format->format);
 	if (wb_state->format == NULL) {
 		dev_dbg(dev->dev, "%s: unsupported format %08x\n", __func__,
@@ -200,6 +321,9 @@ int rcar_du_writeback_init(struct rcar_du_device *rcdu,
 {
 	struct drm_writeback_connector *wb_conn = &rcrtc->writeback;
 
+	mutex_init(&rcrtc->wb_pool.lock);
+	INIT_LIST_HEAD(&rcrtc->wb_pool.jobs);
+
 	wb_conn->encoder.possible_crtcs = 1 << drm_crtc_index(&rcrtc->crtc);
 	drm_connector_helper_add(&wb_conn->base,
 				 &rcar_du_wb_conn_helper_funcs);
@@ -232,7 +356,7 @@ void rcar_du_writeback_setup(struct rcar_du_crtc *rcrtc,
 	cfg->pitch = fb->pitches[0];
 
 	for (i = 0; i < wb_state->format->planes; ++i)
-		cfg->mem[i] = sg_dma_address(rjob->sg_tables[i].sgl)
+		cfg->mem[i] = sg_dma_address(rjob->map->sg_tables[i].sgl)
 			    + fb->offsets[i];
 
 	drm_writeback_queue_job(&rcrtc->writeback, state);
@@ -8,18 +8,62 @@
 #ifndef __RCAR_DU_WRITEBACK_H__
 #define __RCAR_DU_WRITEBACK_H__
 
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#include <drm/drm_connector.h>
 #include <drm/drm_plane.h>
 
+struct drm_framebuffer;
 struct rcar_du_crtc;
 struct rcar_du_device;
+struct rcar_du_format_info;
+struct rcar_du_vsp_fb_map;
 struct vsp1_du_atomic_pipe_config;
 
+#define RCAR_DU_WB_CACHE_SIZE		4
+
+/**
+ * struct rcar_du_wb_pool - Writeback job pool and mapping cache
+ * @lock: protects the pool
+ * @jobs: free job objects, reused for new writeback jobs
+ * @fbs: recently captured framebuffers, most recent first
+ * @maps: VSP mappings of the @fbs framebuffers
+ *
+ * Continuous capture cycles through a small set of framebuffers. The pool
+ * keeps references to the last captured framebuffers and their VSP mappings,
+ * new jobs then find the framebuffer already mapped to the VSP. The cache is
+ * dropped when the writeback connector is detached from the CRTC, or when the
+ * CRTC is disabled.
+ */
+struct rcar_du_wb_pool {
+	struct mutex lock;
+	struct list_head jobs;
+	struct drm_framebuffer *fbs[RCAR_DU_WB_CACHE_SIZE];
+	struct rcar_du_vsp_fb_map *maps[RCAR_DU_WB_CACHE_SIZE];
+};
+
+/**
+ * struct rcar_du_wb_conn_state - Driver-specific writeback connector state
+ * @state: base DRM connector state
+ * @format: format of the writeback framebuffer
+ */
+struct rcar_du_wb_conn_state {
+	struct drm_connector_state state;
+	const struct rcar_du_format_info *format;
+};
+
+#define to_rcar_wb_conn_state(s) \
+	container_of(s, struct rcar_du_wb_conn_state, state)
+
 #ifdef CONFIG_DRM_RCAR_WRITEBACK
 int rcar_du_writeback_init(struct rcar_du_device *rcdu,
 			   struct rcar_du_crtc *rcrtc);
 void rcar_du_writeback_setup(struct rcar_du_crtc *rcrtc,
 			     struct vsp1_du_writeback_config *cfg);
 void rcar_du_writeback_complete(struct rcar_du_crtc *rcrtc);
+void rcar_du_writeback_release_cache(struct rcar_du_crtc *rcrtc);
+bool rcar_du_writeback_pending(struct rcar_du_crtc *rcrtc);
 #else
 static inline int rcar_du_writeback_init(struct rcar_du_device *rcdu,
 					 struct rcar_du_crtc *rcrtc)
@@ -34,6 +78,13 @@ rcar_du_writeback_setup(struct rcar_du_crtc *rcrtc,
 static inline void rcar_du_writeback_complete(struct rcar_du_crtc *rcrtc)
 {
 }
+static inline void rcar_du_writeback_release_cache(struct rcar_du_crtc *rcrtc)
+{
+}
+static inline bool rcar_du_writeback_pending(struct rcar_du_crtc *rcrtc)
+{
+	return false;
+}
 #endif
 
 #endif /* __RCAR_DU_WRITEBACK_H__ */